@@ -0,0 +1,288 @@
+///
+/// Minimal stand-ins for the host project's declarations, so that
+/// RtspUdpH264.h/.cpp can be compiled on their own for benchmarking.
+///
+/// @note Only what the benchmarks exercise is functional: ibitstream and
+/// ParseExpGolombCode read real bits, the performance counter reads
+/// CLOCK_MONOTONIC, and everything DirectShow does nothing.
+#pragma once
+
+#include <vector>
+#include <string>
+#include <bitset>
+#include <cassert>
+#include <cstring>
+#include <climits>
+#include <cstdlib>
+#include <ios>
+#include <algorithm>
+#include <stdint.h>
+#include <time.h>
+
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string.hpp>
+
+using namespace std;
+using namespace boost;
+
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef int64_t LONGLONG;
+typedef LONGLONG REFERENCE_TIME;
+typedef LONG HRESULT;
+typedef int BOOL;
+
+#define TRUE 1
+#define FALSE 0
+#define S_OK 0
+#define SUCCEEDED(hr) ((hr) >= 0)
+#define MAKEFOURCC(a, b, c, d) \
+    (static_cast<DWORD>(static_cast<BYTE>(a)) | \
+    (static_cast<DWORD>(static_cast<BYTE>(b)) << 8) | \
+    (static_cast<DWORD>(static_cast<BYTE>(c)) << 16) | \
+    (static_cast<DWORD>(static_cast<BYTE>(d)) << 24))
+#define arraysize(a) (sizeof(a) / sizeof((a)[0]))
+
+inline LONG
+InterlockedExchange(volatile LONG *target, LONG value)
+{
+    return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline LONG
+InterlockedCompareExchange(volatile LONG *destination, LONG exchange,
+    LONG comparand)
+{
+    return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+
+union LARGE_INTEGER
+{
+    LONGLONG QuadPart;
+};
+
+inline BOOL
+QueryPerformanceFrequency(LARGE_INTEGER *frequency)
+{
+    frequency->QuadPart = 1000000000;
+    return TRUE;
+}
+
+inline BOOL
+QueryPerformanceCounter(LARGE_INTEGER *counter)
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    counter->QuadPart = static_cast<LONGLONG>(now.tv_sec) * 1000000000 +
+        now.tv_nsec;
+    return TRUE;
+}
+
+enum
+{
+    NAL_UT_SLICE = 1,
+    NAL_UT_IDR_SLICE = 5,
+    NAL_UT_SEI = 6,
+    NAL_UT_SPS = 7,
+    NAL_UT_PPS = 8,
+    NAL_UT_STAP_A = 24,
+    NAL_UT_STAP_B = 25,
+    NAL_UT_MTAP16 = 26,
+    NAL_UT_MTAP24 = 27,
+    NAL_UT_FU_A = 28,
+    NAL_UT_FU_B = 29
+};
+
+static const BYTE NAL_UNIT_PREFIX[] = { 0x00, 0x00, 0x00, 0x01 };
+
+inline void
+AppendNalUnitPrefix(vector<BYTE> &frame)
+{
+    frame.insert(frame.end(), NAL_UNIT_PREFIX,
+        NAL_UNIT_PREFIX + arraysize(NAL_UNIT_PREFIX));
+}
+
+inline bool
+SupportedPacketizationMode(const string &mode)
+{
+    return mode.empty() || mode == "0" || mode == "1";
+}
+
+///
+/// @note The benchmarks supply configuration bytes directly, so this only
+/// has to accept the attribute.
+inline bool
+ParseSpropParameterSets(const string &sets, vector<BYTE> &config)
+{
+    static const BYTE CONFIG[] = { 0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00,
+        0x1e, 0x00, 0x00, 0x00, 0x01, 0x68, 0xce };
+
+    config.assign(CONFIG, CONFIG + arraysize(CONFIG));
+    return !sets.empty();
+}
+
+///
+/// Big-endian bit reader with the subset of the host's ibitstream interface
+/// that RtspUdpH264.cpp uses. Extracting into a const value checks that the
+/// bits match it.
+class ibitstream
+{
+public:
+    ibitstream(const BYTE *data, size_t bits) :
+        m_data(data), m_bits(bits), m_position(0), m_good(true) {}
+
+    bool good() const { return m_good; }
+    void setstate(ios_base::iostate) { m_good = false; }
+
+    bool ReadBit()
+    {
+        bool bit = false;
+        if (m_position < m_bits)
+        {
+            bit = (m_data[m_position / CHAR_BIT] >>
+                (CHAR_BIT - 1 - m_position % CHAR_BIT) & 1) != 0;
+            ++m_position;
+        }
+        else
+        {
+            m_good = false;
+        }
+        return bit;
+    }
+
+    DWORD ReadBits(size_t count)
+    {
+        DWORD value = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            value = (value << 1) | (ReadBit() ? 1 : 0);
+        }
+        return value;
+    }
+
+    ibitstream &operator>>(bool &value)
+    {
+        value = ReadBit();
+        return *this;
+    }
+
+    ibitstream &operator>>(BYTE &value)
+    {
+        value = static_cast<BYTE>(ReadBits(CHAR_BIT));
+        return *this;
+    }
+
+    ibitstream &operator>>(const BYTE &expected)
+    {
+        if (ReadBits(CHAR_BIT) != expected)
+        {
+            m_good = false;
+        }
+        return *this;
+    }
+
+    template <size_t N>
+    ibitstream &operator>>(bitset<N> &value)
+    {
+        value = bitset<N>(ReadBits(N));
+        return *this;
+    }
+
+    template <size_t N>
+    ibitstream &operator>>(const bitset<N> &expected)
+    {
+        if (bitset<N>(ReadBits(N)) != expected)
+        {
+            m_good = false;
+        }
+        return *this;
+    }
+
+private:
+    const BYTE *m_data;
+    size_t m_bits;
+    size_t m_position;
+    bool m_good;
+};
+
+typedef unsigned UE_V;
+typedef int SE_V;
+
+inline void
+ParseExpGolombCode(ibitstream &bin, UE_V &value)
+{
+    size_t leadingZeroBits = 0;
+    while (bin.good() && !bin.ReadBit() && leadingZeroBits < 32)
+    {
+        ++leadingZeroBits;
+    }
+    value = (1u << leadingZeroBits) - 1 + bin.ReadBits(leadingZeroBits);
+}
+
+inline void
+ParseExpGolombCode(ibitstream &bin, SE_V &value)
+{
+    UE_V codeNum;
+    ParseExpGolombCode(bin, codeNum);
+    value = (codeNum & 1) != 0 ? static_cast<SE_V>((codeNum + 1) / 2) :
+        -static_cast<SE_V>(codeNum / 2);
+}
+
+///
+/// RTP packet holding its payload, as handed to RTSPUDPEncoding.
+class RTPPacket
+{
+public:
+    RTPPacket(const BYTE *payload, size_t length, DWORD timestamp) :
+        m_payload(payload, payload + length), m_timestamp(timestamp) {}
+
+    BYTE *GetPayloadData() { return &m_payload[0]; }
+    size_t GetPayloadLength() const { return m_payload.size(); }
+    DWORD GetTimestamp() const { return m_timestamp; }
+
+private:
+    vector<BYTE> m_payload;
+    DWORD m_timestamp;
+};
+
+///
+/// Append a packet's payload, less its first offset bytes, to a frame.
+///
+/// @note Only the baseline depacketizer in DepacketizerBenchmark.cpp uses
+/// this.
+inline void
+AppendPacket(RTPPacket *packet, size_t offset, vector<BYTE> &frame)
+{
+    const BYTE *payload = packet->GetPayloadData();
+    frame.insert(frame.end(), payload + offset,
+        payload + packet->GetPayloadLength());
+}
+
+class IMediaSample
+{
+public:
+    HRESULT GetPointer(BYTE **buffer) { *buffer = m_buffer; return S_OK; }
+    long GetSize() { return sizeof m_buffer; }
+    HRESULT SetActualDataLength(long) { return S_OK; }
+    HRESULT SetSyncPoint(BOOL) { return S_OK; }
+    HRESULT SetTime(REFERENCE_TIME *, REFERENCE_TIME *) { return S_OK; }
+
+private:
+    BYTE m_buffer[1];
+};
+
+template <class T>
+class CComPtr
+{
+public:
+    CComPtr() : p(NULL) {}
+    T *operator->() const { return p; }
+    bool operator!=(T *q) const { return p != q; }
+    T *p;
+};
+
+class RTSPSource
+{
+};
@@ -0,0 +1,595 @@
+///
+/// Per-packet cost of H.264 depacketization: the code before specialization
+/// (BaselineH264), the specialized H264Depacketizer behind the same virtual
+/// interface, RTSPUDPH264, and H264Depacketizer called directly.
+///
+/// Build and run from the repository root:
+///
+///     g++ -O2 -DNDEBUG -I. -o bench Benchmarks/DepacketizerBenchmark.cpp
+///     ./bench [payload bytes] [iterations]
+///
+/// @note The baseline and "virtual" rows do the same work, so they compare
+/// the specialization alone. The RTSPUDPH264 rows also include the adapter's
+/// own per-packet work (RTP clock, jitter and load shedding); the "arrival
+/// given" row leaves out reading the clock per packet, as a receive front
+/// end that timestamps packets itself would.
+#include "BenchmarkSupport.h"
+
+#include <cstdio>
+#include <list>
+
+#include "RtspUdpH264.h"
+#include "RtspUdpH264.cpp"
+
+#pragma region RTSPUDPEncoding
+////////////////////////////////////////////////////////////////////////////////
+
+// (The host project defines these; the benchmarks only need ParseSdp to
+// reach ParseFmtp.)
+
+bool
+RTSPUDPEncoding::
+ParseSdp(const string &, double &, const string &fmtpLine,
+    vector<BYTE> &configBytes, int &, int &, HRESULT &hr) const
+{
+    hr = S_OK;
+    return ParseFmtp(fmtpLine, configBytes);
+}
+
+bool
+RTSPUDPEncoding::
+EndOfFrame(RTPPacket *) const
+{
+    return false;
+}
+
+void
+RTSPUDPEncoding::
+ExtractFrame(RTPPacket *, bool, const vector<BYTE> &, vector<BYTE> &,
+    bool &, bool &)
+{
+}
+
+#pragma endregion
+
+#pragma region BaselineH264
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+///
+/// RTSPUDPH264's depacketization before it was specialized, copied here to
+/// measure against: every packetization mode in one virtual class, with the
+/// payload read through ibitstream and rewritten in place.
+class BaselineH264 : public RTSPUDPEncoding
+{
+public:
+    DWORD GetFOURCC() const { return MAKEFOURCC('H','2','6','4'); }
+
+    const string &GetMimeSubtypeName() const
+    {
+        static const string name("H264");
+        return name;
+    }
+
+    bool EndOfFrame(RTPPacket *packet) const;
+
+    void ExtractFrame(RTPPacket *packet, bool marker,
+        const vector<BYTE> &configBytes, vector<BYTE> &frame, bool &fullFrame,
+        bool &keyFrame);
+
+    bool ConstructMediaSample(const BYTE *, const BYTE *, bool,
+        const vector<BYTE> &, const RTSPSource &, bool &,
+        CComPtr<IMediaSample> &) const
+    {
+        return false;
+    }
+
+protected:
+    bool ParseFmtp(const string &, vector<BYTE> &) const { return false; }
+
+    bool ParseConfig(const vector<BYTE> &, int &, int &, double &) const
+    {
+        return false;
+    }
+
+    void SaveInBandParameterSet(const vector<BYTE> &set);
+
+    void AppendInBandParameterSets(vector<BYTE> &frame);
+
+    list<vector<BYTE> > m_inBandParameterSets;
+
+    static const size_t MAXIMUM_IN_BAND_PARAMETER_SETS = 10;
+};
+
+void
+BaselineH264::
+SaveInBandParameterSet(const vector<BYTE> &set)
+{
+    assert(!set.empty());
+
+    // Assure there will be room for this, new parameter set.
+    while (m_inBandParameterSets.size() >= MAXIMUM_IN_BAND_PARAMETER_SETS)
+    {
+        m_inBandParameterSets.pop_front();
+    }
+
+    m_inBandParameterSets.push_back(set);
+
+    assert(!m_inBandParameterSets.empty());
+    assert(m_inBandParameterSets.size() <= MAXIMUM_IN_BAND_PARAMETER_SETS);
+}
+
+void
+BaselineH264::
+AppendInBandParameterSets(vector<BYTE> &frame)
+{
+    assert(!m_inBandParameterSets.empty());
+
+    BOOST_FOREACH(const vector<BYTE> &set, m_inBandParameterSets)
+    {
+        AppendNalUnitPrefix(frame);
+
+        frame.insert(frame.end(), set.begin(), set.end());
+    }
+
+    m_inBandParameterSets.clear();
+
+    assert(m_inBandParameterSets.empty());
+    assert(!frame.empty());
+}
+
+void
+BaselineH264::
+ExtractFrame(RTPPacket *packet, bool marker, const vector<BYTE> &configBytes,
+    vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+{
+    assert(packet != NULL);
+
+    BYTE *payload = packet->GetPayloadData();
+    size_t payloadLength = packet->GetPayloadLength();
+
+    static const bitset<1> forbidden_zero_bit = 0;
+    bitset<2> nal_ref_idc;
+    bitset<5> fragmentation_unit_type;
+    ibitstream bin(payload, payloadLength * CHAR_BIT);
+    bin >> forbidden_zero_bit >> nal_ref_idc >> fragmentation_unit_type;
+
+    // Ignore all packets where NRI, or nal_ref_idc, is 0.
+    if (nal_ref_idc.to_ulong() != 0)
+    {
+        switch (fragmentation_unit_type.to_ulong())
+        {
+        case NAL_UT_FU_A:
+        {
+            bool start_fragment;
+            bool end_fragment;
+            bitset<1> reserved;
+            bitset<5> nal_unit_type;
+            bin >> start_fragment >> end_fragment >> reserved >> nal_unit_type;
+
+            if (start_fragment || frame.empty())
+            {
+                // Should never have start bit set while already assembling
+                // frame. Clear frame just to be sure.
+                frame.clear();
+
+                // Append any picture or sequence parameter sets received since
+                // previous frame.
+                if (!m_inBandParameterSets.empty())
+                {
+                    AppendInBandParameterSets(frame);
+                }
+
+                // NRI + NAL type tells decoder type of NAL unit.
+                payload[1] = static_cast<BYTE>(
+                    (nal_ref_idc.to_ulong() << 5) | nal_unit_type.to_ulong());
+
+                AppendNalUnitPrefix(frame);
+
+                // Don't include FU-indicator byte; not part of payload
+                AppendPacket(packet, 1, frame);
+            }
+            else
+            {
+                // Append fragments without FU-indicator- and FU-header-bytes.
+                AppendPacket(packet, 2, frame);
+            }
+
+            // (If end fragment, RTP marker bit should also be set. The former
+            // is more reliable, though, according to RFC 3894.)
+            if (end_fragment)
+            {
+                if (nal_unit_type.to_ulong() == NAL_UT_IDR_SLICE)
+                {
+                    // IDR frame; prime encoder(s) with SPS & PPS data.
+                    frame.insert(frame.begin(), configBytes.begin(),
+                        configBytes.end());
+                    keyFrame = true;
+                }
+
+                fullFrame = true;
+            }
+            break;
+        }
+        case NAL_UT_STAP_A:
+            break;
+
+        case NAL_UT_STAP_B:
+        case NAL_UT_MTAP16:
+        case NAL_UT_MTAP24:
+        case NAL_UT_FU_B:
+            break;
+
+        case NAL_UT_SPS:
+        case NAL_UT_PPS:
+            // Save parameter set (without RTP header) for subsequent inclusion
+            // with next frame.
+            SaveInBandParameterSet(vector<BYTE>(packet->GetPayloadData(),
+                packet->GetPayloadData() + packet->GetPayloadLength()));
+            break;
+
+        case NAL_UT_IDR_SLICE:
+            frame.clear();
+
+            // IDR frame; prime encoder(s) with SPS & PPS data.
+            frame.insert(frame.begin(), configBytes.begin(), configBytes.end());
+
+            // Append any picture or sequence parameter sets received since
+            // previous frame.
+            if (!m_inBandParameterSets.empty())
+            {
+                AppendInBandParameterSets(frame);
+            }
+
+            AppendNalUnitPrefix(frame);
+
+            // Append entire payload (no FU header bytes to ignore).
+            AppendPacket(packet, 0, frame);
+
+            keyFrame = true; // An IDR slice is inherently a key frame.
+
+            fullFrame = true; // And this is a full frame, too.
+            break;
+
+        default:
+            frame.clear();
+
+            // Append any picture or sequence parameter sets received since
+            // previous frame.
+            if (!m_inBandParameterSets.empty())
+            {
+                AppendInBandParameterSets(frame);
+            }
+
+            AppendNalUnitPrefix(frame);
+
+            AppendPacket(packet, 0, frame);
+
+            fullFrame = true;
+
+            break;
+        }
+    }
+}
+
+bool
+BaselineH264::
+EndOfFrame(RTPPacket *packet) const
+{
+    assert(packet != NULL);
+
+    bool end = false;
+
+    static const bitset<1> forbidden_zero_bit = 0;
+    bitset<2> nal_ref_idc;
+    ibitstream bin(packet->GetPayloadData(),
+        packet->GetPayloadLength() * CHAR_BIT);
+    bin >> forbidden_zero_bit >> nal_ref_idc;
+
+    if (nal_ref_idc.to_ulong() != 0)
+    {
+        bitset<5> fragmentation_unit_type;
+        bin >> fragmentation_unit_type;
+        switch (fragmentation_unit_type.to_ulong())
+        {
+        case NAL_UT_FU_A:
+        case NAL_UT_FU_B:
+            bool start;
+            bin >> start >> end;
+            break;
+
+        default:
+            // Do nothing.
+            break;
+        }
+    }
+
+    return end;
+}
+
+///
+/// The RTSPUDPEncoding interface over a specialized depacketizer and nothing
+/// else, i.e., the same work as BaselineH264. (It borrows BaselineH264's
+/// stubs for the rest of the interface.)
+template <class Depacketizer>
+class SpecializedH264 : public BaselineH264
+{
+public:
+    bool EndOfFrame(RTPPacket *packet) const
+    {
+        return Depacketizer::EndOfFrame(packet);
+    }
+
+    void ExtractFrame(RTPPacket *packet, bool, const vector<BYTE> &configBytes,
+        vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+    {
+        m_depacketizer.ExtractFrame(packet, configBytes, frame, fullFrame,
+            keyFrame);
+    }
+
+protected:
+    Depacketizer m_depacketizer;
+};
+}
+
+#pragma endregion
+
+#pragma region Benchmark
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+///
+/// Frames per second and RTP timestamp ticks between frames.
+const DWORD FRAME_RATE = 30;
+const DWORD FRAME_TICKS = 90000 / FRAME_RATE;
+
+///
+/// Fragmentation units per IDR frame and per other frame.
+const size_t IDR_FRAGMENTS = 16;
+const size_t FRAGMENTS = 4;
+
+///
+/// Append one NAL unit, either whole or as FU-A fragments, each payload at
+/// most payloadSize bytes.
+void
+AppendNalUnit(BYTE nal_unit_type, size_t fragments, size_t payloadSize,
+    DWORD timestamp, vector<RTPPacket> &packets)
+{
+    // NRI 3; first_mb_in_slice 0, slice_type 0, pic_parameter_set_id 0.
+    const BYTE header = static_cast<BYTE>(0x60 | nal_unit_type);
+    vector<BYTE> payload(payloadSize, 0xE0);
+
+    if (fragments == 0)
+    {
+        payload[0] = header;
+        packets.push_back(RTPPacket(&payload[0], payload.size(), timestamp));
+    }
+    else
+    {
+        payload[0] = static_cast<BYTE>(0x60 | NAL_UT_FU_A);
+        for (size_t i = 0; i < fragments; ++i)
+        {
+            payload[1] = static_cast<BYTE>((i == 0 ? 0x80 : 0x00) |
+                (i + 1 == fragments ? 0x40 : 0x00) | nal_unit_type);
+            packets.push_back(RTPPacket(&payload[0], payload.size(),
+                timestamp));
+        }
+    }
+}
+
+///
+/// One second of video, with an IDR frame first.
+vector<RTPPacket>
+MakeStream(bool fragmented, size_t payloadSize)
+{
+    vector<RTPPacket> packets;
+    for (DWORD i = 0; i < FRAME_RATE; ++i)
+    {
+        const bool idr = i == 0;
+        AppendNalUnit(idr ? NAL_UT_IDR_SLICE : NAL_UT_SLICE,
+            !fragmented ? 0 : idr ? IDR_FRAGMENTS : FRAGMENTS, payloadSize,
+            i * FRAME_TICKS, packets);
+    }
+    return packets;
+}
+
+double
+Seconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+///
+/// Feed the stream through encoding iterations times.
+///
+/// @return Nanoseconds per packet.
+double
+Run(RTSPUDPEncoding &encoding, const vector<BYTE> &config,
+    vector<RTPPacket> &packets, size_t iterations, size_t &checksum)
+{
+    vector<BYTE> frame;
+    const double start = Seconds();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        BOOST_FOREACH(RTPPacket &packet, packets)
+        {
+            // (BaselineH264 rewrites the FU header in place, so put it back
+            // for the next iteration. Every row through this interface pays
+            // for that alike.)
+            BYTE &header = packet.GetPayloadData()[1];
+            const BYTE saved = header;
+
+            bool fullFrame = false;
+            bool keyFrame = false;
+            checksum += encoding.EndOfFrame(&packet);
+            encoding.ExtractFrame(&packet, false, config, frame, fullFrame,
+                keyFrame);
+            header = saved;
+            if (fullFrame)
+            {
+                checksum += frame.size() + keyFrame;
+                frame.clear();
+            }
+        }
+    }
+    return (Seconds() - start) * 1e9 / (iterations * packets.size());
+}
+
+///
+/// Feed the stream through the adapter's template path, with the arrival time
+/// given as a receive front end such as RTPBatchReceiver would.
+///
+/// @return Nanoseconds per packet.
+double
+Run(RTSPUDPH264 &h264, const vector<BYTE> &config, vector<RTPPacket> &packets,
+    size_t iterations, size_t &checksum)
+{
+    vector<BYTE> frame;
+    const REFERENCE_TIME arrival = RTPClock::Now();
+    const double start = Seconds();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        BOOST_FOREACH(RTPPacket &packet, packets)
+        {
+            bool fullFrame = false;
+            bool keyFrame = false;
+            checksum += h264.EndOfFrame(&packet);
+            h264.ExtractFrame(&packet, arrival, config, frame, fullFrame,
+                keyFrame);
+            if (fullFrame)
+            {
+                checksum += frame.size() + keyFrame;
+                frame.clear();
+            }
+        }
+    }
+    return (Seconds() - start) * 1e9 / (iterations * packets.size());
+}
+
+///
+/// Feed the stream straight into a specialized depacketizer.
+///
+/// @return Nanoseconds per packet.
+template <class Depacketizer>
+double
+Run(const vector<BYTE> &config, vector<RTPPacket> &packets,
+    size_t iterations, size_t &checksum)
+{
+    Depacketizer depacketizer;
+    vector<BYTE> frame;
+    const double start = Seconds();
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        BOOST_FOREACH(RTPPacket &packet, packets)
+        {
+            bool fullFrame = false;
+            bool keyFrame = false;
+            checksum += Depacketizer::EndOfFrame(&packet);
+            depacketizer.ExtractFrame(&packet, config, frame, fullFrame,
+                keyFrame);
+            if (fullFrame)
+            {
+                checksum += frame.size() + keyFrame;
+                frame.clear();
+            }
+        }
+    }
+    return (Seconds() - start) * 1e9 / (iterations * packets.size());
+}
+
+///
+/// Set up an adapter for the given packetization mode.
+void
+Configure(RTSPUDPH264 &h264, const char *mode, vector<BYTE> &config)
+{
+    const string fmtp = string("a=fmtp:96 packetization-mode=") + mode +
+        ";sprop-parameter-sets=Z0IAHg==,aM4=";
+    double frameRate;
+    int width;
+    int height;
+    HRESULT hr;
+    RTSPUDPEncoding &encoding = h264;
+    if (!encoding.ParseSdp("H264", frameRate, fmtp, config, width, height,
+        hr))
+    {
+        fprintf(stderr, "Could not parse %s\n", fmtp.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+}
+
+int
+main(int argc, char *argv[])
+{
+    const size_t payloadSize = argc > 1 ? strtoul(argv[1], NULL, 10) : 1200;
+    const size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : 20000;
+    if (payloadSize < 8 || iterations == 0)
+    {
+        fprintf(stderr, "Usage: %s [payload bytes >= 8] [iterations]\n",
+            argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t checksum = 0;
+    vector<RTPPacket> fragmented = MakeStream(true, payloadSize);
+    vector<RTPPacket> single = MakeStream(false, payloadSize);
+
+    printf("%zu-byte payloads, %zu iterations\n\n", payloadSize, iterations);
+    printf("%-58s %8s\n", "Path", "ns/pkt");
+
+    typedef H264Depacketizer<H264_SINGLE_NAL_UNIT_MODE, AnnexBFormat>
+        SingleNalUnitDepacketizer;
+    typedef H264Depacketizer<H264_NON_INTERLEAVED_MODE, AnnexBFormat>
+        Depacketizer;
+    typedef H264Depacketizer<H264_NON_INTERLEAVED_MODE, LengthPrefixedFormat>
+        LengthPrefixedDepacketizer;
+
+    BaselineH264 baseline;
+    SpecializedH264<Depacketizer> specialized;
+    RTSPUDPH264 nonInterleaved;
+    vector<BYTE> config;
+    Configure(nonInterleaved, "1", config);
+    printf("%-58s %8.1f\n", "FU-A: BaselineH264 (virtual)",
+        Run(baseline, config, fragmented, iterations, checksum));
+    printf("%-58s %8.1f\n",
+        "FU-A: H264Depacketizer<NON_INTERLEAVED, AnnexB> (virtual)",
+        Run(specialized, config, fragmented, iterations, checksum));
+    printf("%-58s %8.1f\n", "FU-A: RTSPUDPH264 (virtual, mode 1)",
+        Run(static_cast<RTSPUDPEncoding &>(nonInterleaved), config,
+            fragmented, iterations, checksum));
+    printf("%-58s %8.1f\n", "FU-A: RTSPUDPH264 (arrival given, mode 1)",
+        Run(nonInterleaved, config, fragmented, iterations, checksum));
+    printf("%-58s %8.1f\n",
+        "FU-A: H264Depacketizer<NON_INTERLEAVED, AnnexB>",
+        Run<Depacketizer>(config, fragmented, iterations, checksum));
+    printf("%-58s %8.1f\n",
+        "FU-A: H264Depacketizer<NON_INTERLEAVED, LengthPrefixed>",
+        Run<LengthPrefixedDepacketizer>(config, fragmented, iterations,
+            checksum));
+
+    RTSPUDPH264 singleNalUnit;
+    Configure(singleNalUnit, "0", config);
+    printf("%-58s %8.1f\n", "Single NAL unit: BaselineH264 (virtual)",
+        Run(baseline, config, single, iterations, checksum));
+    printf("%-58s %8.1f\n", "Single NAL unit: RTSPUDPH264 (virtual, mode 0)",
+        Run(static_cast<RTSPUDPEncoding &>(singleNalUnit), config, single,
+            iterations, checksum));
+    printf("%-58s %8.1f\n",
+        "Single NAL unit: H264Depacketizer<SINGLE_NAL_UNIT, AnnexB>",
+        Run<SingleNalUnitDepacketizer>(config, single, iterations,
+            checksum));
+    printf("%-58s %8.1f\n",
+        "Single NAL unit: H264Depacketizer<NON_INTERLEAVED, AnnexB>",
+        Run<Depacketizer>(config, single, iterations, checksum));
+
+    // (Keeps the compiler from discarding the work.)
+    printf("\nChecksum %zu\n", checksum);
+
+    return EXIT_SUCCESS;
+}
+
+#pragma endregion
@@ -0,0 +1,250 @@
+///
+/// System calls per packet for RTPBatchReceiver versus one recvfrom per
+/// packet, over loopback. Packets received in batches are also fed through
+/// RTSPUDPH264 as RTPPacketViews and checked against what was sent.
+///
+/// Build and run from the repository root (Linux only):
+///
+///     g++ -O2 -I. -o loopback Benchmarks/RtpBatchReceiverLoopback.cpp
+///     ./loopback [packets]
+///
+/// @return 0 if every packet arrived intact on both paths.
+#include "BenchmarkSupport.h"
+
+#include <cstdio>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "RtpBatchReceiver.h"
+#include "RtpBatchReceiver.cpp"
+#include "RtspUdpH264.h"
+#include "RtspUdpH264.cpp"
+
+#pragma region RTSPUDPEncoding
+////////////////////////////////////////////////////////////////////////////////
+
+// (The host project defines these; nothing here calls them.)
+
+bool
+RTSPUDPEncoding::
+ParseSdp(const string &, double &, const string &, vector<BYTE> &, int &,
+    int &, HRESULT &hr) const
+{
+    hr = S_OK;
+    return false;
+}
+
+bool
+RTSPUDPEncoding::
+EndOfFrame(RTPPacket *) const
+{
+    return false;
+}
+
+void
+RTSPUDPEncoding::
+ExtractFrame(RTPPacket *, bool, const vector<BYTE> &, vector<BYTE> &,
+    bool &, bool &)
+{
+}
+
+#pragma endregion
+
+#pragma region Loopback
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+const uint32_t SSRC = 0x12345678;
+const size_t STREAM = 1;
+const size_t PAYLOAD_SIZE = 64;
+
+///
+/// RTP packet i: one single-NAL-unit slice per frame, payload bytes
+/// derived from i.
+void
+MakePacket(size_t i, vector<BYTE> &datagram)
+{
+    const DWORD timestamp = static_cast<DWORD>(i * 3000);
+
+    datagram.assign(12 + PAYLOAD_SIZE, 0);
+    datagram[0] = 0x80;
+    datagram[1] = 0x80 | 96;
+    datagram[2] = static_cast<BYTE>(i >> 8);
+    datagram[3] = static_cast<BYTE>(i);
+    datagram[4] = static_cast<BYTE>(timestamp >> 24);
+    datagram[5] = static_cast<BYTE>(timestamp >> 16);
+    datagram[6] = static_cast<BYTE>(timestamp >> 8);
+    datagram[7] = static_cast<BYTE>(timestamp);
+    datagram[8] = static_cast<BYTE>(SSRC >> 24);
+    datagram[9] = static_cast<BYTE>(SSRC >> 16);
+    datagram[10] = static_cast<BYTE>(SSRC >> 8);
+    datagram[11] = static_cast<BYTE>(SSRC);
+    datagram[12] = 0x60 | NAL_UT_SLICE;
+    for (size_t j = 13; j < datagram.size(); ++j)
+    {
+        datagram[j] = static_cast<BYTE>(i + j);
+    }
+}
+
+bool
+Send(int socket, const sockaddr_in &address, size_t packets)
+{
+    bool sent = true;
+    vector<BYTE> datagram;
+    for (size_t i = 0; i < packets && sent; ++i)
+    {
+        MakePacket(i, datagram);
+        sent = sendto(socket, &datagram[0], datagram.size(), 0,
+            reinterpret_cast<const sockaddr *>(&address), sizeof address) ==
+            static_cast<ssize_t>(datagram.size());
+    }
+    return sent;
+}
+
+///
+/// Whether this packet is the i-th one sent.
+bool
+Matches(const RTPPacketView &view, size_t i)
+{
+    vector<BYTE> datagram;
+    MakePacket(i, datagram);
+    return view.IsValid() && view.GetSequenceNumber() == (i & 0xFFFF) &&
+        view.GetSSRC() == SSRC && view.GetPayloadLength() == PAYLOAD_SIZE &&
+        memcmp(view.GetPayloadData(), &datagram[12], PAYLOAD_SIZE) == 0;
+}
+
+///
+/// Receive with RTPBatchReceiver, passing each view to RTSPUDPH264.
+bool
+ReceiveBatches(int socket, size_t packets, uint64_t &systemCalls)
+{
+    RTPBatchReceiver receiver(socket);
+    receiver.AddStream(SSRC, STREAM);
+
+    RTSPUDPH264 h264;
+    vector<BYTE> config;
+    vector<BYTE> frame;
+    size_t received = 0;
+    size_t frames = 0;
+    bool intact = true;
+    size_t count;
+    while (receiver.Receive(count) && count != 0)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            const RTPPacketView &view = receiver.GetPacket(i);
+            intact = intact && Matches(view, received) &&
+                view.GetStream() == STREAM && view.GetArrivalTime() != 0;
+            ++received;
+
+            bool fullFrame = false;
+            bool keyFrame = false;
+            // (Nanoseconds to 100-nanosecond units. RTPClock::Now reads
+            // CLOCK_MONOTONIC here, too.)
+            h264.ExtractFrame(&view,
+                static_cast<REFERENCE_TIME>(view.GetArrivalTime() / 100),
+                config, frame, fullFrame, keyFrame);
+            if (fullFrame)
+            {
+                intact = intact && frame.size() ==
+                    arraysize(NAL_UNIT_PREFIX) + PAYLOAD_SIZE &&
+                    memcmp(&frame[arraysize(NAL_UNIT_PREFIX)],
+                    view.GetPayloadData(), PAYLOAD_SIZE) == 0;
+                ++frames;
+                frame.clear();
+            }
+        }
+    }
+
+    systemCalls = receiver.GetSystemCallCount();
+    return intact && received == packets && frames == packets;
+}
+
+///
+/// Receive with one recvfrom per packet.
+bool
+ReceiveSingly(int socket, size_t packets, uint64_t &systemCalls)
+{
+    vector<BYTE> buffer(2048);
+    size_t received = 0;
+    bool intact = true;
+    ssize_t length;
+
+    systemCalls = 0;
+    do
+    {
+        ++systemCalls;
+        length = recvfrom(socket, &buffer[0], buffer.size(), 0, NULL, NULL);
+        if (length >= 0)
+        {
+            RTPPacketView view;
+            view.Parse(&buffer[0], static_cast<size_t>(length));
+            intact = intact && Matches(view, received);
+            ++received;
+        }
+    } while (length >= 0 || errno == EINTR);
+
+    return intact && received == packets &&
+        (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+}
+
+int
+main(int argc, char *argv[])
+{
+    const size_t packets = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+
+    const int receiver = socket(AF_INET, SOCK_DGRAM, 0);
+    const int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addressLength = sizeof address;
+    int bufferSize = 4 << 20;
+    if (receiver < 0 || sender < 0 ||
+        bind(receiver, reinterpret_cast<sockaddr *>(&address),
+            sizeof address) != 0 ||
+        getsockname(receiver, reinterpret_cast<sockaddr *>(&address),
+            &addressLength) != 0 ||
+        setsockopt(receiver, SOL_SOCKET, SO_RCVBUF, &bufferSize,
+            sizeof bufferSize) != 0 ||
+        fcntl(receiver, F_SETFL, O_NONBLOCK) != 0)
+    {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    // Queue everything first, so each path sees the same backlog. (If the
+    // kernel's receive buffer can't hold it all, packets are lost and the
+    // run fails; try fewer.)
+    uint64_t batchCalls = 0;
+    uint64_t singleCalls = 0;
+    const bool batched = Send(sender, address, packets) &&
+        ReceiveBatches(receiver, packets, batchCalls);
+    const bool single = Send(sender, address, packets) &&
+        ReceiveSingly(receiver, packets, singleCalls);
+
+    printf("%zu packets\n\n", packets);
+    printf("%-12s %10s %12s %s\n", "Path", "Syscalls", "Packets/call",
+        "Result");
+    printf("%-12s %10llu %12.1f %s\n", "recvmmsg",
+        static_cast<unsigned long long>(batchCalls),
+        batchCalls != 0 ? static_cast<double>(packets) / batchCalls : 0.0,
+        batched ? "ok" : "MISMATCH");
+    printf("%-12s %10llu %12.1f %s\n", "recvfrom",
+        static_cast<unsigned long long>(singleCalls),
+        singleCalls != 0 ? static_cast<double>(packets) / singleCalls : 0.0,
+        single ? "ok" : "MISMATCH");
+
+    close(sender);
+    close(receiver);
+
+    return batched && single ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#pragma endregion
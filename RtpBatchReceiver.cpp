@@ -0,0 +1,206 @@
+#include "RtpBatchReceiver.h"
+
+#ifdef __linux__
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+RTPPacketView::
+RTPPacketView() :
+    m_marker(false),
+    m_payloadType(0),
+    m_sequenceNumber(0),
+    m_timestamp(0),
+    m_ssrc(0),
+    m_payload(NULL),
+    m_payloadLength(0),
+    m_stream(RTPBatchReceiver::UNKNOWN_STREAM),
+    m_arrivalTime(0)
+{
+}
+
+bool
+RTPPacketView::
+Parse(const uint8_t *data, size_t length)
+{
+    static const size_t FIXED_HEADER_SIZE = 12;
+    static const uint8_t RTP_VERSION = 2;
+
+    m_payload = NULL;
+    m_payloadLength = 0;
+
+    if (data != NULL && length >= FIXED_HEADER_SIZE &&
+        (data[0] >> 6) == RTP_VERSION)
+    {
+        const bool padding = (data[0] & 0x20) != 0;
+        const bool extension = (data[0] & 0x10) != 0;
+        const size_t csrcCount = data[0] & 0x0F;
+
+        m_marker = (data[1] & 0x80) != 0;
+        m_payloadType = data[1] & 0x7F;
+        m_sequenceNumber = static_cast<uint16_t>((data[2] << 8) | data[3]);
+        m_timestamp = (static_cast<uint32_t>(data[4]) << 24) |
+            (static_cast<uint32_t>(data[5]) << 16) |
+            (static_cast<uint32_t>(data[6]) << 8) | data[7];
+        m_ssrc = (static_cast<uint32_t>(data[8]) << 24) |
+            (static_cast<uint32_t>(data[9]) << 16) |
+            (static_cast<uint32_t>(data[10]) << 8) | data[11];
+
+        size_t begin = FIXED_HEADER_SIZE + csrcCount * 4;
+        size_t end = length;
+
+        // Header extension: 16-bit profile, 16-bit length in 32-bit words.
+        if (extension && begin + 4 <= end)
+        {
+            begin += 4 + 4 * ((data[begin + 2] << 8) | data[begin + 3]);
+        }
+        else if (extension)
+        {
+            begin = end + 1;
+        }
+
+        // Last byte of padding says how many padding bytes there are. It
+        // counts itself, so 0 is malformed, as is more than the payload.
+        if (padding)
+        {
+            const size_t paddingLength = end > begin ? data[end - 1] : 0;
+            end = paddingLength != 0 && paddingLength <= end - begin ?
+                end - paddingLength : begin;
+        }
+
+        // (A packet with an empty payload is legal, but useless to us.)
+        if (begin < end)
+        {
+            m_payload = data + begin;
+            m_payloadLength = end - begin;
+        }
+    }
+
+    return IsValid();
+}
+
+RTPBatchReceiver::
+RTPBatchReceiver(int socket, size_t batchSize, size_t bufferSize,
+    size_t ringDepth) :
+    m_socket(socket),
+    m_batchSize(batchSize),
+    m_bufferSize(bufferSize),
+    m_ringDepth(ringDepth),
+    m_batch(0),
+    m_count(0),
+    m_buffers(batchSize * bufferSize * ringDepth),
+    m_iovecs(batchSize * ringDepth),
+    m_messages(batchSize * ringDepth),
+    m_views(batchSize * ringDepth),
+    m_systemCalls(0),
+    m_packets(0)
+{
+    assert(batchSize != 0);
+    assert(bufferSize != 0);
+    assert(ringDepth != 0);
+
+    // Point each message at its slot in the ring once, up front; recvmmsg
+    // only ever writes msg_len and msg_flags after that.
+    memset(&m_messages[0], 0, m_messages.size() * sizeof(m_messages[0]));
+    for (size_t i = 0; i < m_messages.size(); ++i)
+    {
+        m_iovecs[i].iov_base = &m_buffers[i * bufferSize];
+        m_iovecs[i].iov_len = bufferSize;
+        m_messages[i].msg_hdr.msg_iov = &m_iovecs[i];
+        m_messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // Start at the last batch so the first Receive fills the first.
+    m_batch = (ringDepth - 1) * batchSize;
+}
+
+void
+RTPBatchReceiver::
+AddStream(uint32_t ssrc, size_t stream)
+{
+    m_streams[ssrc] = stream;
+}
+
+bool
+RTPBatchReceiver::
+Receive(size_t &count)
+{
+    bool received = false;
+
+    count = 0;
+
+    m_batch += m_batchSize;
+    if (m_batch == m_views.size())
+    {
+        m_batch = 0;
+    }
+
+    int result;
+    do
+    {
+        ++m_systemCalls;
+        result = recvmmsg(m_socket, &m_messages[m_batch],
+            static_cast<unsigned int>(m_batchSize), MSG_WAITFORONE, NULL);
+    } while (result < 0 && errno == EINTR);
+
+    uint64_t arrivalTime = 0;
+    if (result >= 0)
+    {
+        count = static_cast<size_t>(result);
+        received = true;
+
+        // Every packet in the batch was queued by the time recvmmsg
+        // returned; that's as close to arrival as one clock read per batch
+        // gets.
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        arrivalTime = static_cast<uint64_t>(now.tv_sec) * 1000000000 +
+            now.tv_nsec;
+    }
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+        received = true;
+    }
+
+    for (size_t i = m_batch; i < m_batch + count; ++i)
+    {
+        RTPPacketView &view = m_views[i];
+        const struct msghdr &header = m_messages[i].msg_hdr;
+
+        view.m_arrivalTime = arrivalTime;
+
+        // Discard datagrams that didn't fit in a buffer.
+        if ((header.msg_flags & MSG_TRUNC) == 0 &&
+            view.Parse(&m_buffers[i * m_bufferSize], m_messages[i].msg_len))
+        {
+            std::map<uint32_t, size_t>::const_iterator stream =
+                m_streams.find(view.GetSSRC());
+            view.m_stream = stream != m_streams.end() ?
+                stream->second : UNKNOWN_STREAM;
+        }
+        else
+        {
+            view.m_payload = NULL;
+            view.m_payloadLength = 0;
+            view.m_stream = UNKNOWN_STREAM;
+        }
+    }
+
+    m_count = count;
+    m_packets += count;
+
+    return received;
+}
+
+const RTPPacketView &
+RTPBatchReceiver::
+GetPacket(size_t index) const
+{
+    assert(index < m_count);
+
+    return m_views[m_batch + index];
+}
+
+#endif // __linux__
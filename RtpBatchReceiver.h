@@ -0,0 +1,174 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <map>
+#include <vector>
+
+///
+/// Non-owning view of an RTP packet held in someone else's buffer.
+///
+/// @note Provides the same payload accessors as RTPPacket, so a view can be
+/// handed straight to H264Depacketizer without copying the packet.
+class RTPPacketView
+{
+public:
+    RTPPacketView();
+
+    ///
+    /// Parse the fixed RTP header, CSRC list, header extension and padding.
+    ///
+    /// @post Returns IsValid().
+    ///
+    /// @param[in] data Beginning of the datagram. Must outlive this view.
+    /// @param[in] length Length of the datagram in bytes.
+    /// @return Whether the datagram is a well-formed RTP version 2 packet.
+    bool Parse(const uint8_t *data, size_t length);
+
+    ///
+    /// Whether the last call to Parse succeeded.
+    bool IsValid() const { return m_payload != NULL; }
+
+    bool HasMarker() const { return m_marker; }
+    uint8_t GetPayloadType() const { return m_payloadType; }
+    uint16_t GetSequenceNumber() const { return m_sequenceNumber; }
+    uint32_t GetTimestamp() const { return m_timestamp; }
+    uint32_t GetSSRC() const { return m_ssrc; }
+    const uint8_t *GetPayloadData() const { return m_payload; }
+    size_t GetPayloadLength() const { return m_payloadLength; }
+
+    ///
+    /// Stream to which RTPBatchReceiver demultiplexed this packet.
+    ///
+    /// @return Stream registered with RTPBatchReceiver::AddStream, or
+    /// RTPBatchReceiver::UNKNOWN_STREAM.
+    size_t GetStream() const { return m_stream; }
+
+    ///
+    /// When RTPBatchReceiver received the batch containing this packet.
+    ///
+    /// @note Taken once per batch, as recvmmsg returns, so it doesn't
+    /// include the time spent processing the packets ahead of this one.
+    ///
+    /// @return CLOCK_MONOTONIC time in nanoseconds.
+    uint64_t GetArrivalTime() const { return m_arrivalTime; }
+
+protected:
+    friend class RTPBatchReceiver;
+
+    bool m_marker;
+    uint8_t m_payloadType;
+    uint16_t m_sequenceNumber;
+    uint32_t m_timestamp;
+    uint32_t m_ssrc;
+    const uint8_t *m_payload;
+    size_t m_payloadLength;
+    size_t m_stream;
+    uint64_t m_arrivalTime;
+};
+
+///
+/// Receive RTP packets from a UDP socket in batches with recvmmsg.
+///
+/// @note The receiver owns a ring of preallocated datagram buffers, divided
+/// into batches. Each call to Receive fills the next batch directly from the
+/// kernel (one system call for up to a whole batch) and parses each datagram
+/// into an RTPPacketView in place; nothing is copied or allocated per packet.
+/// Views from a batch stay valid until the ring wraps around to that batch
+/// again, i.e., for the next ringDepth - 1 calls to Receive.
+///
+/// @note One receiver serves one socket, i.e., one local port. Packets on
+/// that port are demultiplexed to streams by SSRC.
+class RTPBatchReceiver
+{
+public:
+    ///
+    /// Stream of packets whose SSRC wasn't registered with AddStream.
+    static const size_t UNKNOWN_STREAM = static_cast<size_t>(-1);
+
+    ///
+    /// Constructor.
+    ///
+    /// @pre socket is a bound UDP socket; batchSize, bufferSize and ringDepth
+    /// are non-zero.
+    ///
+    /// @param[in] socket Socket from which to receive. Not owned.
+    /// @param[in] batchSize Maximum number of datagrams per system call.
+    /// @param[in] bufferSize Size of each datagram buffer; larger datagrams
+    /// are discarded.
+    /// @param[in] ringDepth Number of batches in the ring.
+    RTPBatchReceiver(int socket, size_t batchSize = 64,
+        size_t bufferSize = 2048, size_t ringDepth = 2);
+
+    ///
+    /// Route packets with this SSRC to a stream.
+    ///
+    /// @param[in] ssrc Synchronization source.
+    /// @param[in] stream Caller-defined stream identifier.
+    void AddStream(uint32_t ssrc, size_t stream);
+
+    ///
+    /// Receive a batch of packets.
+    ///
+    /// @note Blocks, unless the socket is non-blocking, until at least one
+    /// datagram is available, then takes as many more as are already queued,
+    /// up to the batch size, without blocking again.
+    ///
+    /// @post On success, GetPacket(0..count - 1) are the packets received.
+    ///
+    /// @param[out] count Number of packets received, including invalid ones.
+    /// @return Whether the receive succeeded. On failure, errno says why. A
+    /// non-blocking socket with nothing queued succeeds with count == 0.
+    bool Receive(size_t &count);
+
+    ///
+    /// Get a packet from the most recent batch.
+    ///
+    /// @pre index < count from the most recent call to Receive.
+    ///
+    /// @param[in] index Index of the packet within the batch.
+    /// @return View of the packet; check IsValid before use.
+    const RTPPacketView &GetPacket(size_t index) const;
+
+    ///
+    /// Number of receive system calls made.
+    uint64_t GetSystemCallCount() const { return m_systemCalls; }
+
+    ///
+    /// Number of datagrams received.
+    uint64_t GetPacketCount() const { return m_packets; }
+
+protected:
+    int m_socket;
+    size_t m_batchSize;
+    size_t m_bufferSize;
+    size_t m_ringDepth;
+
+    ///
+    /// First slot of the most recent batch.
+    size_t m_batch;
+
+    ///
+    /// Number of packets in the most recent batch.
+    size_t m_count;
+
+    ///
+    /// Datagram buffers, ringDepth * batchSize slots of bufferSize bytes.
+    std::vector<uint8_t> m_buffers;
+    std::vector<struct iovec> m_iovecs;
+    std::vector<struct mmsghdr> m_messages;
+    std::vector<RTPPacketView> m_views;
+
+    ///
+    /// SSRC to stream.
+    std::map<uint32_t, size_t> m_streams;
+
+    uint64_t m_systemCalls;
+    uint64_t m_packets;
+};
+
+#endif // __linux__
@@ -1,6 +1,22 @@
 #pragma region RTSPUDPH264
 ////////////////////////////////////////////////////////////////////////////////
 
+RTSPUDPH264::
+RTSPUDPH264() :
+    m_endOfFrame(&Depacketizer::EndOfFrame<Payload>),
+    m_extractFrame(&RTSPUDPH264::ExtractNonInterleavedFrame),
+    m_clock(CLOCK_RATE),
+    m_sampleTimestamp(0),
+    m_sampleArrivalTimestamp(0),
+    m_sampleStart(0),
+    m_sampleEnd(0),
+    m_frameDuration(0),
+    m_haveSample(false)
+{
+    m_depacketizer.SetLoadShedder(&m_shedder);
+    m_interleavedDepacketizer.SetLoadShedder(&m_shedder);
+}
+
 DWORD
 RTSPUDPH264::
 GetFOURCC() const
@@ -40,6 +56,8 @@ ParseFmtp(const string &line, vector<BYTE> &config) const
         split(fmtp_parts, trimmed, is_any_of(" ;"), token_compress_on);
         string modeString;
         string sets;
+        string depthString;
+        string maxDonDiffString;
         BOOST_FOREACH(const string &parameter, fmtp_parts)
         {
             if (starts_with(parameter, "packetization-mode"))
@@ -60,10 +78,55 @@ ParseFmtp(const string &line, vector<BYTE> &config) const
                     sets = &parameter[iIndex];
                 }
             }
+            else if (starts_with(parameter, "sprop-interleaving-depth"))
+            {
+                string::size_type iIndex = parameter.find("=");
+                if (iIndex != string::npos)
+                {
+                    iIndex++; // move past '='
+                    depthString = &parameter[iIndex];
+                }
+            }
+            else if (starts_with(parameter, "sprop-max-don-diff"))
+            {
+                string::size_type iIndex = parameter.find("=");
+                if (iIndex != string::npos)
+                {
+                    iIndex++; // move past '='
+                    maxDonDiffString = &parameter[iIndex];
+                }
+            }
         }
 
-        parsed = SupportedPacketizationMode(modeString) &&
+        // SupportedPacketizationMode only knows the non-interleaved modes.
+        const bool interleaved = modeString == "2";
+        parsed = (interleaved || SupportedPacketizationMode(modeString)) &&
             ParseSpropParameterSets(sets, config);
+
+        if (parsed)
+        {
+            // Choose the depacketizer here, once, rather than per packet.
+            // (Single NAL unit sessions get the non-interleaved one, which
+            // also takes the fragmentation units some cameras send anyway.)
+            if (interleaved)
+            {
+                m_endOfFrame = &InterleavedDepacketizer::EndOfFrame<Payload>;
+                m_extractFrame = &RTSPUDPH264::ExtractInterleavedFrame;
+
+                // (If sprop-max-don-diff is absent, we go by
+                // sprop-interleaving-depth alone.)
+                m_interleavedDepacketizer.Configure(
+                    strtoul(depthString.c_str(), NULL, 10),
+                    maxDonDiffString.empty() ?
+                        H264Deinterleaver::UNLIMITED_DON_DIFF :
+                        strtoul(maxDonDiffString.c_str(), NULL, 10));
+            }
+            else
+            {
+                m_endOfFrame = &Depacketizer::EndOfFrame<Payload>;
+                m_extractFrame = &RTSPUDPH264::ExtractNonInterleavedFrame;
+            }
+        }
     }
 
     return parsed;
@@ -78,6 +141,623 @@ ParseConfig(const vector<BYTE> &bytes, int &width, int &height,
 
     static const BYTE zero_byte = 0x00;
     static const bitset<24> start_code_prefix_one_3bytes = 0x000001;
+    H264SequenceParameterSet sps;
+
+    bin >> zero_byte
+        >> start_code_prefix_one_3bytes;
+    sps.Parse(bin);
+
+    width = sps.width;
+    height = sps.height;
+
+    // (The load shedder needs these to find frame_num in slice headers.)
+    if (bin.good())
+    {
+        m_shedder.SetSequenceParameters(sps.log2MaxFrameNum,
+            sps.separateColourPlane);
+    }
+
+    return bin.good();
+}
+
+void
+RTSPUDPH264::
+ExtractFrame(RTPPacket *packet, bool marker, const vector<BYTE> &configBytes,
+    vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+{
+    // (The host's socket layer doesn't say when the packet arrived.)
+    ExtractFrame<RTPPacket>(packet, RTPClock::Now(), configBytes, frame,
+        fullFrame, keyFrame);
+}
+
+bool
+RTSPUDPH264::
+EndOfFrame(RTPPacket *packet) const
+{
+    return EndOfFrame<RTPPacket>(packet);
+}
+
+void
+RTSPUDPH264::
+ExtractNonInterleavedFrame(Payload *payload, const vector<BYTE> &configBytes,
+    vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+{
+    m_depacketizer.ExtractFrame(payload, configBytes, frame, fullFrame,
+        keyFrame);
+    m_sampleTimestamp = m_depacketizer.GetFrameTimestamp();
+    m_sampleArrivalTimestamp = m_depacketizer.GetArrivalTimestamp();
+}
+
+void
+RTSPUDPH264::
+ExtractInterleavedFrame(Payload *payload, const vector<BYTE> &configBytes,
+    vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+{
+    m_interleavedDepacketizer.ExtractFrame(payload, configBytes, frame,
+        fullFrame, keyFrame);
+    m_sampleTimestamp = m_interleavedDepacketizer.GetFrameTimestamp();
+    m_sampleArrivalTimestamp =
+        m_interleavedDepacketizer.GetArrivalTimestamp();
+}
+
+bool
+RTSPUDPH264::
+HasPendingFrame() const
+{
+    // (Only the interleaved depacketizer ever has any.)
+    return m_interleavedDepacketizer.HasPendingFrame();
+}
+
+void
+RTSPUDPH264::
+ExtractPendingFrame(vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+{
+    if (HasPendingFrame())
+    {
+        m_interleavedDepacketizer.ExtractPendingFrame(frame, fullFrame,
+            keyFrame);
+        m_sampleTimestamp = m_interleavedDepacketizer.GetFrameTimestamp();
+        m_sampleArrivalTimestamp =
+            m_interleavedDepacketizer.GetArrivalTimestamp();
+        StampFrame();
+    }
+}
+
+unsigned long
+RTSPUDPH264::
+GetDroppedFrameCount() const
+{
+    return m_interleavedDepacketizer.GetDroppedFrameCount();
+}
+
+void
+RTSPUDPH264::
+StampFrame()
+{
+    // Each frame lasts until the next one with a later timestamp, which we
+    // don't know yet, so go by the interval before it. (Frames with the same
+    // timestamp, e.g., separate slices, don't change the interval.)
+    REFERENCE_TIME start = m_clock.GetPresentationTime(m_sampleTimestamp);
+    if (m_haveSample && start > m_sampleStart)
+    {
+        m_frameDuration = start - m_sampleStart;
+    }
+    m_sampleStart = start;
+    m_sampleEnd = start + m_frameDuration;
+    m_haveSample = true;
+}
+
+bool
+RTSPUDPH264::
+ConstructMediaSample(const BYTE *Begin, const BYTE *End, bool keyFrame,
+    const vector<BYTE> &configBytes, const RTSPSource &source,
+    bool &got_keyframe, CComPtr<IMediaSample> &sample) const
+{
+    bool constructed = false;
+
+    assert(Begin != NULL);
+    assert(End != NULL);
+    assert(sample != NULL);
+
+    if (Begin != NULL && End != NULL)
+    {
+        size_t frameSize = End - Begin;
+
+        static const bitset<1> forbidden_zero_bit = 0;
+        bitset<2> nal_ref_idc;
+        bitset<5> nal_unit_type;
+        ibitstream bin(Begin, frameSize * CHAR_BIT);
+        for (size_t i = 0; i < arraysize(NAL_UNIT_PREFIX); ++i)
+        {
+            bin >> NAL_UNIT_PREFIX[i];
+        }
+        bin >> forbidden_zero_bit >> nal_ref_idc >> nal_unit_type;
+        if (bin.good())
+        {
+            BYTE *buf;
+            if (SUCCEEDED(sample->GetPointer(&buf)))
+            {
+                assert(sample->GetSize() > frameSize);
+
+                memcpy(buf, Begin, static_cast<int> (frameSize));
+                sample->SetActualDataLength(static_cast<int> (frameSize));
+                sample->SetSyncPoint(keyFrame ? TRUE : FALSE);
+
+                // Present on the sender's clock rather than on arrival. (Until
+                // there have been two frames, we don't know how long they
+                // last, so leave the end time unset.)
+                REFERENCE_TIME start = m_sampleStart;
+                REFERENCE_TIME end = m_sampleEnd;
+                sample->SetTime(&start, m_frameDuration != 0 ? &end : NULL);
+
+                // (The clock only knows packet timestamps, which differ from
+                // frame timestamps for NAL units in MTAPs.)
+                REFERENCE_TIME arrival;
+                if (m_clock.GetFirstArrival(m_sampleArrivalTimestamp,
+                    arrival))
+                {
+                    m_latency.Record(RTPClock::Now() - arrival);
+                }
+
+                constructed = true;
+            }
+        }
+    }
+
+    return constructed;
+}
+
+void
+RTSPUDPH264::
+OnSenderReport(DWORD ntpSeconds, DWORD ntpFraction, DWORD timestamp)
+{
+    m_clock.OnSenderReport(ntpSeconds, ntpFraction, timestamp);
+}
+
+DWORD
+RTSPUDPH264::
+GetJitter() const
+{
+    return m_clock.GetJitter();
+}
+
+const LatencyHistogram &
+RTSPUDPH264::
+GetLatencyHistogram() const
+{
+    return m_latency;
+}
+
+H264LoadShedder &
+RTSPUDPH264::
+GetLoadShedder()
+{
+    return m_shedder;
+}
+
+#pragma endregion
+
+#pragma region H264Deinterleaver
+////////////////////////////////////////////////////////////////////////////////
+
+H264Deinterleaver::
+H264Deinterleaver() :
+    m_interleavingDepth(0),
+    m_maxDonDiff(UNLIMITED_DON_DIFF),
+    m_highestDon(0),
+    m_vclNalUnits(0),
+    m_current(NO_SLOT),
+    m_releasedDon(0),
+    m_released(false)
+{
+    Configure(0, UNLIMITED_DON_DIFF);
+}
+
+void
+H264Deinterleaver::
+Configure(size_t interleavingDepth, size_t maxDonDiff)
+{
+    m_interleavingDepth = interleavingDepth < MAXIMUM_INTERLEAVING_DEPTH ?
+        interleavingDepth : MAXIMUM_INTERLEAVING_DEPTH;
+    m_maxDonDiff = maxDonDiff < UNLIMITED_DON_DIFF ?
+        maxDonDiff : UNLIMITED_DON_DIFF;
+
+    // Allocate the whole pool and its bookkeeping now, so that buffering
+    // never has to.
+    const size_t slots = m_interleavingDepth + 1 + EXTRA_SLOTS;
+    m_slots.resize(slots);
+    m_free.clear();
+    m_free.reserve(slots);
+    for (size_t i = slots; i != 0; --i)
+    {
+        m_free.push_back(i - 1);
+    }
+    m_buffered.clear();
+    m_buffered.reserve(slots);
+
+    m_vclNalUnits = 0;
+    m_current = NO_SLOT;
+    m_released = false;
+}
+
+vector<BYTE> *
+H264Deinterleaver::
+BeginNalUnit(WORD don, DWORD timestamp, DWORD packetTimestamp)
+{
+    vector<BYTE> *nalUnit = NULL;
+
+    AbortNalUnit();
+
+    assert(!IsFull());
+
+    // A NAL unit that should already have been decoded is useless now.
+    if ((!m_released || DonDiff(m_releasedDon, don) > 0) && !m_free.empty())
+    {
+        m_current = m_free.back();
+        m_free.pop_back();
+
+        Slot &slot = m_slots[m_current];
+        slot.don = don;
+        slot.timestamp = timestamp;
+        slot.packetTimestamp = packetTimestamp;
+        slot.nalUnit.clear();
+        nalUnit = &slot.nalUnit;
+    }
+
+    return nalUnit;
+}
+
+vector<BYTE> &
+H264Deinterleaver::
+CurrentNalUnit()
+{
+    assert(InNalUnit());
+
+    return m_slots[m_current].nalUnit;
+}
+
+void
+H264Deinterleaver::
+EndNalUnit()
+{
+    assert(InNalUnit());
+
+    const vector<BYTE> &nalUnit = m_slots[m_current].nalUnit;
+    if (!nalUnit.empty())
+    {
+        // (Slice types 1 through 5 are the VCL NAL units.)
+        const BYTE nal_unit_type = nalUnit[0] & 0x1F;
+        if (nal_unit_type >= NAL_UT_SLICE && nal_unit_type <= NAL_UT_IDR_SLICE)
+        {
+            ++m_vclNalUnits;
+        }
+
+        // Track the highest DON so MustRelease needn't look at every slot.
+        const WORD don = m_slots[m_current].don;
+        if (m_buffered.empty() || DonDiff(m_highestDon, don) > 0)
+        {
+            m_highestDon = don;
+        }
+
+        m_buffered.push_back(m_current);
+        push_heap(m_buffered.begin(), m_buffered.end(), LaterDon(m_slots));
+    }
+    else
+    {
+        m_free.push_back(m_current);
+    }
+
+    m_current = NO_SLOT;
+
+    assert(!InNalUnit());
+}
+
+void
+H264Deinterleaver::
+AbortNalUnit()
+{
+    if (InNalUnit())
+    {
+        m_free.push_back(m_current);
+        m_current = NO_SLOT;
+    }
+
+    assert(!InNalUnit());
+}
+
+bool
+H264Deinterleaver::
+MustRelease() const
+{
+    bool release = false;
+
+    if (!m_buffered.empty())
+    {
+        if (m_vclNalUnits > m_interleavingDepth)
+        {
+            release = true;
+        }
+        else if (m_maxDonDiff < UNLIMITED_DON_DIFF)
+        {
+            // Span of the buffered DONs, from the lowest to the highest.
+            release = static_cast<size_t>(DonDiff(Front().don,
+                m_highestDon)) > m_maxDonDiff;
+        }
+    }
+
+    return release;
+}
+
+const H264Deinterleaver::Slot &
+H264Deinterleaver::
+Front() const
+{
+    assert(!m_buffered.empty());
+
+    return m_slots[m_buffered.front()];
+}
+
+void
+H264Deinterleaver::
+PopFront()
+{
+    assert(!m_buffered.empty());
+
+    const size_t index = m_buffered.front();
+    const Slot &slot = m_slots[index];
+
+    const BYTE nal_unit_type = slot.nalUnit[0] & 0x1F;
+    if (nal_unit_type >= NAL_UT_SLICE && nal_unit_type <= NAL_UT_IDR_SLICE)
+    {
+        assert(m_vclNalUnits != 0);
+        --m_vclNalUnits;
+    }
+
+    m_releasedDon = slot.don;
+    m_released = true;
+
+    // (The highest DON stays put unless this was the last NAL unit.)
+    pop_heap(m_buffered.begin(), m_buffered.end(), LaterDon(m_slots));
+    m_buffered.pop_back();
+    m_free.push_back(index);
+}
+
+int
+H264Deinterleaver::
+DonDiff(WORD m, WORD n)
+{
+    // From RFC 6184, section 5.5: positive if n follows m in decoding order,
+    // negative if it precedes m, with DONs wrapping modulo 2^16.
+    return static_cast<short>(static_cast<WORD>(n - m));
+}
+
+#pragma endregion
+
+#pragma region LatencyHistogram
+////////////////////////////////////////////////////////////////////////////////
+
+LatencyHistogram::
+LatencyHistogram()
+{
+    memset(m_counts, 0, sizeof(m_counts));
+}
+
+void
+LatencyHistogram::
+Record(REFERENCE_TIME latency)
+{
+    // (Latency is in 100-nanosecond units; buckets are in microseconds.)
+    LONGLONG microseconds = latency / 10;
+    size_t bucket = 0;
+    while (microseconds > 1 && bucket < BUCKETS - 1)
+    {
+        microseconds >>= 1;
+        ++bucket;
+    }
+
+    ++m_counts[bucket];
+}
+
+unsigned long
+LatencyHistogram::
+GetCount(size_t bucket) const
+{
+    assert(bucket < BUCKETS);
+
+    return m_counts[bucket];
+}
+
+#pragma endregion
+
+#pragma region RTPClock
+////////////////////////////////////////////////////////////////////////////////
+
+///
+/// One second in 100-nanosecond units.
+static const REFERENCE_TIME ONE_SECOND = 10000000;
+
+RTPClock::
+RTPClock(DWORD clockRate) :
+    m_clockRate(clockRate),
+    m_extended(false),
+    m_highest(0),
+    m_first(0),
+    m_haveSenderReport(false),
+    m_reportTimestamp(0),
+    m_reportTime(0),
+    m_origin(0),
+    m_jitter(0),
+    m_transit(0),
+    m_haveTransit(false),
+    m_lastArrival(ARRIVALS - 1),
+    m_arrivalCount(0)
+{
+    assert(clockRate != 0);
+}
+
+REFERENCE_TIME
+RTPClock::
+Now()
+{
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    // (Split to keep counter * ONE_SECOND from overflowing.)
+    return counter.QuadPart / frequency.QuadPart * ONE_SECOND +
+        counter.QuadPart % frequency.QuadPart * ONE_SECOND /
+        frequency.QuadPart;
+}
+
+void
+RTPClock::
+OnPacket(DWORD timestamp, REFERENCE_TIME arrival)
+{
+    const LONGLONG extended = Extend(timestamp);
+
+    // Interarrival jitter, from RFC 3550, appendix A.8, with the arrival time
+    // converted to RTP timestamp units.
+    const LONGLONG transit = arrival / ONE_SECOND * m_clockRate +
+        arrival % ONE_SECOND * m_clockRate / ONE_SECOND - extended;
+    if (m_haveTransit)
+    {
+        LONGLONG d = transit - m_transit;
+        if (d < 0)
+        {
+            d = -d;
+        }
+        m_jitter += d - ((m_jitter + 8) >> 4);
+    }
+    m_transit = transit;
+    m_haveTransit = true;
+
+    // Remember when the first packet with each timestamp arrived.
+    if (m_arrivalCount == 0 ||
+        m_arrivalTimestamps[m_lastArrival] != timestamp)
+    {
+        m_lastArrival = (m_lastArrival + 1) % ARRIVALS;
+        m_arrivalTimestamps[m_lastArrival] = timestamp;
+        m_arrivals[m_lastArrival] = arrival;
+        if (m_arrivalCount < ARRIVALS)
+        {
+            ++m_arrivalCount;
+        }
+    }
+}
+
+void
+RTPClock::
+OnSenderReport(DWORD ntpSeconds, DWORD ntpFraction, DWORD timestamp)
+{
+    const REFERENCE_TIME time = ntpSeconds * ONE_SECOND +
+        ((static_cast<LONGLONG>(ntpFraction) * ONE_SECOND) >> 32);
+    const LONGLONG extended = Extend(timestamp);
+
+    if (!m_haveSenderReport)
+    {
+        // Keep presentation times continuous across the first report.
+        m_origin = time + ToReferenceTime(m_first - extended);
+        m_haveSenderReport = true;
+    }
+
+    m_reportTimestamp = extended;
+    m_reportTime = time;
+}
+
+REFERENCE_TIME
+RTPClock::
+GetPresentationTime(DWORD timestamp)
+{
+    const LONGLONG extended = Extend(timestamp);
+
+    return m_haveSenderReport ?
+        m_reportTime + ToReferenceTime(extended - m_reportTimestamp) -
+            m_origin :
+        ToReferenceTime(extended - m_first);
+}
+
+bool
+RTPClock::
+GetFirstArrival(DWORD timestamp, REFERENCE_TIME &arrival) const
+{
+    bool found = false;
+
+    // Oldest first, in case a timestamp recurs (e.g., interleaved mode).
+    size_t i = (m_lastArrival + ARRIVALS + 1 - m_arrivalCount) % ARRIVALS;
+    for (size_t n = 0; n < m_arrivalCount && !found; ++n)
+    {
+        if (m_arrivalTimestamps[i] == timestamp)
+        {
+            arrival = m_arrivals[i];
+            found = true;
+        }
+        i = (i + 1) % ARRIVALS;
+    }
+
+    return found;
+}
+
+DWORD
+RTPClock::
+GetJitter() const
+{
+    return static_cast<DWORD>(m_jitter >> 4);
+}
+
+LONGLONG
+RTPClock::
+Extend(DWORD timestamp)
+{
+    if (!m_extended)
+    {
+        m_highest = timestamp;
+        m_first = timestamp;
+        m_extended = true;
+    }
+
+    // The signed 32-bit difference from the highest timestamp so far is
+    // right as long as timestamps aren't more than 2^31 ticks apart.
+    const LONGLONG extended = m_highest +
+        static_cast<int>(timestamp - static_cast<DWORD>(m_highest));
+    if (extended > m_highest)
+    {
+        m_highest = extended;
+    }
+
+    return extended;
+}
+
+REFERENCE_TIME
+RTPClock::
+ToReferenceTime(LONGLONG ticks) const
+{
+    return ticks / m_clockRate * ONE_SECOND +
+        ticks % m_clockRate * ONE_SECOND / m_clockRate;
+}
+
+#pragma endregion
+
+#pragma region H264SequenceParameterSet
+////////////////////////////////////////////////////////////////////////////////
+
+H264SequenceParameterSet::
+H264SequenceParameterSet() :
+    width(0),
+    height(0),
+    log2MaxFrameNum(0),
+    separateColourPlane(false)
+{
+}
+
+bool
+H264SequenceParameterSet::
+Parse(ibitstream &bin)
+{
     static const bitset<1> forbidden_zero_bit = 0;
     bitset<2> nal_ref_idc;
     bitset<5> nal_unit_type;
@@ -87,7 +767,7 @@ ParseConfig(const vector<BYTE> &bytes, int &width, int &height,
     BYTE level_idc;
     UE_V seq_parameter_set_id;
     UE_V chroma_format_idc;
-    bool separate_colour_plane_flag;
+    bool separate_colour_plane_flag = false;
     UE_V bit_depth_luma_minus8;
     UE_V bit_depth_chroma_minus8;
     bool qpprime_y_zero_transform_bypass_flag;
@@ -107,9 +787,7 @@ ParseConfig(const vector<BYTE> &bytes, int &width, int &height,
     UE_V pic_height_in_map_units_minus1;
     bool frame_mbs_only_flag;
 
-    bin >> zero_byte
-        >> start_code_prefix_one_3bytes
-        >> forbidden_zero_bit
+    bin >> forbidden_zero_bit
         >> nal_ref_idc
         >> nal_unit_type;
     bin >> profile_idc;
@@ -225,286 +903,173 @@ ParseConfig(const vector<BYTE> &bytes, int &width, int &height,
     height = (pic_height_in_map_units_minus1 + 1) * 16 * (2 - frame_mbs_only_flag);
     // We don't care about the fields that follow...
 
+    log2MaxFrameNum = log2_max_frame_num_minus4 + 4;
+    separateColourPlane = separate_colour_plane_flag;
+
     return bin.good();
 }
 
-void
-RTSPUDPH264::
-SaveInBandParameterSet(const vector<BYTE> &set)
-{
-    assert(!set.empty());
-
-    // Assure there will be room for this, new parameter set.
-    while (m_inBandParameterSets.size() >= MAXIMUM_IN_BAND_PARAMETER_SETS)
-    {
-        m_inBandParameterSets.pop_front();
-    }
+#pragma endregion
 
-    m_inBandParameterSets.push_back(set);
+#pragma region H264LoadShedder
+////////////////////////////////////////////////////////////////////////////////
 
-    assert(!m_inBandParameterSets.empty());
-    assert(m_inBandParameterSets.size() <= MAXIMUM_IN_BAND_PARAMETER_SETS);
+H264LoadShedder::
+H264LoadShedder() :
+    m_log2MaxFrameNum(0),
+    m_separateColourPlane(false),
+    m_priority(1),
+    m_queueDepth(0),
+    m_awaitingIdr(false),
+    m_shedding(false),
+    m_frameNum(0)
+{
+    memset(m_shedCounts, 0, sizeof(m_shedCounts));
 }
 
 void
-RTSPUDPH264::
-AppendInBandParameterSets(vector<BYTE> &frame)
+H264LoadShedder::
+SetSequenceParameters(unsigned log2MaxFrameNum, bool separateColourPlane)
 {
-    assert(!m_inBandParameterSets.empty());
+    m_log2MaxFrameNum = log2MaxFrameNum;
+    m_separateColourPlane = separateColourPlane;
+}
 
-    BOOST_FOREACH(const vector<BYTE> &set, m_inBandParameterSets)
+void
+H264LoadShedder::
+OnSequenceParameterSet(const BYTE *nalUnit, size_t length)
+{
+    ibitstream bin(nalUnit, length * CHAR_BIT);
+    H264SequenceParameterSet sps;
+    if (sps.Parse(bin))
     {
-        AppendNalUnitPrefix(frame);
-
-        frame.insert(frame.end(), set.begin(), set.end());
+        SetSequenceParameters(sps.log2MaxFrameNum, sps.separateColourPlane);
     }
-
-    m_inBandParameterSets.clear();
-
-    assert(m_inBandParameterSets.empty());
-    assert(!frame.empty());
 }
 
 void
-RTSPUDPH264::
-ExtractFrame(RTPPacket *packet, bool marker, const vector<BYTE> &configBytes,
-    vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+H264LoadShedder::
+SetPriority(unsigned priority)
 {
-    assert(packet != NULL);
+    InterlockedExchange(&m_priority,
+        priority != 0 ? static_cast<LONG>(priority) : 1);
+}
 
-    BYTE *payload = packet->GetPayloadData();
-    size_t payloadLength = packet->GetPayloadLength();
+void
+H264LoadShedder::
+ReportQueueDepth(size_t depth)
+{
+    InterlockedExchange(&m_queueDepth,
+        depth < LONG_MAX ? static_cast<LONG>(depth) : LONG_MAX);
+}
 
-    static const bitset<1> forbidden_zero_bit = 0;
-    bitset<2> nal_ref_idc;
-    bitset<5> fragmentation_unit_type;
-    ibitstream bin(payload, payloadLength * CHAR_BIT);
-    bin >> forbidden_zero_bit >> nal_ref_idc >> fragmentation_unit_type;
-
-    // Ignore all packets where NRI, or nal_ref_idc, is 0.
-    //
-    // We primarily do this because the SEI packets from some cameras cause
-    // the UMC H.264 decoder we use to throw an exception. This is safe to do
-    // because, from RFC3984: "nal_ref_idc. ... a value of 00 indicates that
-    // the content of the NAL unit is not used to reconstruct reference
-    // pictures for inter picture prediction. Such NAL units can be discarded
-    // without risking the integrity of the reference pictures." and
-    // "Intelligent receivers having to discard packets or NALUs should first
-    // discard all packets/NALUs in which the value of the NRI field of the NAL
-    // unit type octet is equal to 0. This will minimize the impact on user
-    // experience and keep the reference pictures intact."
-    if (nal_ref_idc.to_ulong() != 0)
+bool
+H264LoadShedder::
+Shed(BYTE nal_ref_idc, BYTE nal_unit_type, const BYTE *sliceHeader,
+    size_t length)
+{
+    // Only slices are ever dropped; SEI, parameter sets and the like are
+    // small and may be needed by whatever frames we do keep.
+    if (nal_unit_type >= NAL_UT_SLICE && nal_unit_type <= NAL_UT_IDR_SLICE)
     {
-        switch (fragmentation_unit_type.to_ulong())
-        {
-        case NAL_UT_FU_A:
+        bool firstSlice;
+        unsigned frameNum;
+        const H264FrameClass frameClass = Classify(nal_ref_idc,
+            nal_unit_type, sliceHeader, length, firstSlice, frameNum);
+
+        // The rest of a picture's slices go the way of its first slice.
+        if (firstSlice || frameNum != m_frameNum)
         {
-            bool start_fragment;
-            bool end_fragment;
-            bitset<1> reserved;
-            bitset<5> nal_unit_type;
-            bin >> start_fragment >> end_fragment >> reserved >> nal_unit_type;
+            // (Interlocked reads, since other threads set these.)
+            const size_t priority = static_cast<size_t>(
+                InterlockedCompareExchange(&m_priority, 0, 0));
+            const size_t queueDepth = static_cast<size_t>(
+                InterlockedCompareExchange(&m_queueDepth, 0, 0));
 
-            if (start_fragment || frame.empty())
+            switch (frameClass)
             {
-                // Should never have start bit set while already assembling
-                // frame. Clear frame just to be sure.
-                frame.clear();
-
-                // Append any picture or sequence parameter sets received since
-                // previous frame.
-                if (!m_inBandParameterSets.empty())
+            case H264_IDR_FRAME:
+                // Everything after an IDR frame can be decoded again.
+                m_awaitingIdr = false;
+                m_shedding = false;
+                break;
+
+            case H264_REFERENCE_FRAME:
+                if (!m_awaitingIdr &&
+                    queueDepth >= REFERENCE_QUEUE_DEPTH * priority)
                 {
-                    AppendInBandParameterSets(frame);
+                    m_awaitingIdr = true;
                 }
-
-                // NRI + NAL type tells decoder type of NAL unit.
-                payload[1] = static_cast<BYTE>(
-                    (nal_ref_idc.to_ulong() << 5) | nal_unit_type.to_ulong());
-
-                AppendNalUnitPrefix(frame);
-
-                // Don't include FU-indicator byte; not part of payload
-                AppendPacket(packet, 1, frame);
-            }
-            else
-            {
-                // Append fragments without FU-indicator- and FU-header-bytes.
-                AppendPacket(packet, 2, frame);
+                m_shedding = m_awaitingIdr;
+                break;
+
+            case H264_NON_REFERENCE_FRAME:
+            default:
+                m_shedding = m_awaitingIdr ||
+                    queueDepth >= NON_REFERENCE_QUEUE_DEPTH * priority;
+                break;
             }
 
-            // (If end fragment, RTP marker bit should also be set. The former
-            // is more reliable, though, according to RFC 3894.)
-            if (end_fragment)
-            {
-                if (nal_unit_type.to_ulong() == NAL_UT_IDR_SLICE)
-                {
-                    // IDR frame; prime encoder(s) with SPS & PPS data.
-                    frame.insert(frame.begin(), configBytes.begin(),
-                        configBytes.end());
-                    keyFrame = true;
-                }
+            m_frameNum = frameNum;
 
-                fullFrame = true;
-            }
-            break;
-        }
-        case NAL_UT_STAP_A:
-            // TBD - Supposed to support for packetization-mode=1. Ignore for
-            // now (we haven't encountered from any cameras).
-            break;
-
-        case NAL_UT_STAP_B:
-        case NAL_UT_MTAP16:
-        case NAL_UT_MTAP24:
-        case NAL_UT_FU_B:
-            // Not allowed for packetization-mode=1 (non-interleaved), which
-            // is all we support.
-            break;
-
-        case NAL_UT_SPS:
-        case NAL_UT_PPS:
-            // Save parameter set (without RTP header) for subsequent inclusion
-            // with next frame.
-            SaveInBandParameterSet(vector<BYTE>(packet->GetPayloadData(),
-                packet->GetPayloadData() + packet->GetPayloadLength()));
-            break;
-
-        case NAL_UT_IDR_SLICE:
-            // Any frame made up of fragmentation units should have been
-            // completed by now. IOW, the frame vector should now be empty.
-            // Just in case it isn't, however, clear it.
-            frame.clear();
-
-            // IDR frame; prime encoder(s) with SPS & PPS data.
-            frame.insert(frame.begin(), configBytes.begin(), configBytes.end());
-
-            // Append any picture or sequence parameter sets received since
-            // previous frame.
-            if (!m_inBandParameterSets.empty())
+            if (m_shedding)
             {
-                AppendInBandParameterSets(frame);
+                ++m_shedCounts[frameClass];
             }
-
-            AppendNalUnitPrefix(frame);
-
-            // Append entire payload (no FU header bytes to ignore).
-            AppendPacket(packet, 0, frame);
-
-            keyFrame = true; // An IDR slice is inherently a key frame.
-
-            fullFrame = true; // And this is a full frame, too.
-            break;
-
-        default:
-            // A non-fragmentation-unit should never appear with fragmentation
-            // units. We could assert(frame.empty()). Instead, to gracefully
-            // handle this error, just make sure we're not appending this NAL
-            // unit to others.
-            frame.clear();
-
-            // Append any picture or sequence parameter sets received since
-            // previous frame.
-            if (!m_inBandParameterSets.empty())
-            {
-                AppendInBandParameterSets(frame);
-            }
-
-            // NOTE: Could a non-FU-A ever be a keyframe? If so, should we prepend
-            // SPS & PPS? Maybe we never encounter these packets in practice.
-
-            AppendNalUnitPrefix(frame);
-
-            AppendPacket(packet, 0, frame);
-
-            fullFrame = true;
-
-            break;
         }
     }
+
+    return m_shedding &&
+        nal_unit_type >= NAL_UT_SLICE && nal_unit_type <= NAL_UT_IDR_SLICE;
 }
 
-bool
-RTSPUDPH264::
-EndOfFrame(RTPPacket *packet) const
+unsigned long
+H264LoadShedder::
+GetShedCount(H264FrameClass frameClass) const
 {
-    assert(packet != NULL);
-
-    bool end = false;
-
-    // For H.264, we need to wade into the payload to determine end of frame.
-    // (The RTP marker bit is also set, just like MPEG4; however, the standard
-    // for RTP H.264 packetization, RFC3984, says, don't rely on that.)
-    static const bitset<1> forbidden_zero_bit = 0;
-    bitset<2> nal_ref_idc;
-    ibitstream bin(packet->GetPayloadData(),
-        packet->GetPayloadLength() * CHAR_BIT);
-    bin >> forbidden_zero_bit >> nal_ref_idc;
+    assert(frameClass < H264_FRAME_CLASSES);
 
-    if (nal_ref_idc.to_ulong() != 0)
-    {
-        bitset<5> fragmentation_unit_type;
-        bin >> fragmentation_unit_type;
-        switch (fragmentation_unit_type.to_ulong())
-        {
-        case NAL_UT_FU_A:
-        // (We don't support B, but end bit applies to this type, too.)
-        case NAL_UT_FU_B:
-            bool start;
-            bin >> start >> end;
-            break;
-
-        default:
-            // Do nothing.
-            break;
-        }
-    }
-
-    return end;
+    return m_shedCounts[frameClass];
 }
 
-bool
-RTSPUDPH264::
-ConstructMediaSample(const BYTE *Begin, const BYTE *End, bool keyFrame,
-    const vector<BYTE> &configBytes, const RTSPSource &source,
-    bool &got_keyframe, CComPtr<IMediaSample> &sample) const
+H264FrameClass
+H264LoadShedder::
+Classify(BYTE nal_ref_idc, BYTE nal_unit_type, const BYTE *sliceHeader,
+    size_t length, bool &firstSlice, unsigned &frameNum) const
 {
-    bool constructed = false;
-
-    assert(Begin != NULL);
-    assert(End != NULL);
-    assert(sample != NULL);
-
-    if (Begin != NULL && End != NULL)
+    UE_V first_mb_in_slice;
+    UE_V slice_type; // Don't care about value, but it precedes frame_num
+    UE_V pic_parameter_set_id;
+    bitset<2> colour_plane_id;
+
+    // We only need the first few fields of the slice header.
+    ibitstream bin(sliceHeader, length * CHAR_BIT);
+    ParseExpGolombCode(bin, first_mb_in_slice);
+    ParseExpGolombCode(bin, slice_type);
+    ParseExpGolombCode(bin, pic_parameter_set_id);
+    if (m_separateColourPlane)
     {
-        size_t frameSize = End - Begin;
-
-        static const bitset<1> forbidden_zero_bit = 0;
-        bitset<2> nal_ref_idc;
-        bitset<5> nal_unit_type;
-        ibitstream bin(Begin, frameSize * CHAR_BIT);
-        for (size_t i = 0; i < arraysize(NAL_UNIT_PREFIX); ++i)
-        {
-            bin >> NAL_UNIT_PREFIX[i];
-        }
-        bin >> forbidden_zero_bit >> nal_ref_idc >> nal_unit_type;
-        if (bin.good())
-        {
-            BYTE *buf;
-            if (SUCCEEDED(sample->GetPointer(&buf)))
-            {
-                assert(sample->GetSize() > frameSize);
-
-                memcpy(buf, Begin, static_cast<int> (frameSize));
-                sample->SetActualDataLength(static_cast<int> (frameSize));
-                sample->SetSyncPoint(keyFrame ? TRUE : FALSE);
+        bin >> colour_plane_id;
+    }
+    frameNum = 0;
+    for (unsigned i = 0; i < m_log2MaxFrameNum; ++i)
+    {
+        bool bit;
+        bin >> bit;
+        frameNum = (frameNum << 1) | (bit ? 1 : 0);
+    }
 
-                constructed = true;
-            }
-        }
+    // If the header is cut short, treat the slice as starting a picture.
+    firstSlice = !bin.good() || first_mb_in_slice == 0;
+    if (!bin.good() || m_log2MaxFrameNum == 0)
+    {
+        frameNum = m_frameNum;
     }
 
-    return constructed;
+    // NOTE: We don't resume after shedding at a non-IDR I picture (slice_type
+    // 2 or 7). Pictures after it may still reference pictures before it.
+    return nal_unit_type == NAL_UT_IDR_SLICE ? H264_IDR_FRAME :
+        nal_ref_idc != 0 ? H264_REFERENCE_FRAME : H264_NON_REFERENCE_FRAME;
 }
 
 #pragma endregion
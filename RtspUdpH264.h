@@ -55,6 +55,33 @@ public:
         const vector<BYTE> &configBytes, vector<BYTE> &frame, bool &fullFrame,
         bool &keyFrame);
 
+    ///
+    /// Determine whether the last packet completed more frames than
+    /// ExtractFrame returned.
+    ///
+    /// @note Some encodings (e.g., H.264 in interleaved mode) can complete
+    /// several frames with one packet. After each call to ExtractFrame, call
+    /// ExtractPendingFrame, and construct a media sample for each frame,
+    /// until this returns false. Frames still pending when the next packet
+    /// arrives are dropped.
+    ///
+    /// @return Whether there is a pending frame.
+    virtual bool HasPendingFrame() const { return false; }
+
+    ///
+    /// Extract the next frame completed by the last packet, if any.
+    ///
+    /// @param[out] frame Receives the frame, replacing what was there.
+    /// @param[out] fullFrame Whether a frame was extracted.
+    /// @param[out] keyFrame Whether this is a keyframe.
+    virtual void ExtractPendingFrame(vector<BYTE> &frame, bool &fullFrame,
+        bool &keyFrame)
+    {
+        (void) frame;
+        (void) fullFrame;
+        (void) keyFrame;
+    }
+
     ///
     /// Construct media sample containing compressed frame.
     ///
@@ -95,91 +122,400 @@ protected:
 };
 
 ///
-/// H.264-specific behavior.
-class RTSPUDPH264 : public RTSPUDPEncoding
+/// H.264 packetization modes, from the packetization-mode fmtp parameter.
+enum H264PacketizationMode
+{
+    H264_SINGLE_NAL_UNIT_MODE = 0,
+    H264_NON_INTERLEAVED_MODE = 1,
+    H264_INTERLEAVED_MODE = 2
+};
+
+///
+/// Output format where each NAL unit is preceded by the Annex B start-code
+/// prefix. This is what the decoders downstream of RTSPSource expect.
+struct AnnexBFormat
+{
+    ///
+    /// Begin a NAL unit in a frame.
+    ///
+    /// @param[in,out] frame Frame to which the NAL-unit prefix is appended.
+    /// @return Offset of the prefix, to be passed to EndNalUnit.
+    static size_t BeginNalUnit(vector<BYTE> &frame)
+    {
+        size_t offset = frame.size();
+        AppendNalUnitPrefix(frame);
+        return offset;
+    }
+
+    ///
+    /// Finish a NAL unit started with BeginNalUnit.
+    ///
+    /// @param[in,out] frame Frame containing the NAL unit.
+    /// @param[in] offset Offset returned by BeginNalUnit.
+    static void EndNalUnit(vector<BYTE> &frame, size_t offset)
+    {
+        // The start-code prefix doesn't depend on the NAL-unit size.
+        (void) frame;
+        (void) offset;
+    }
+
+    ///
+    /// Append configuration bytes from the SDP line, a=fmtp, to a frame.
+    ///
+    /// @param[in] configBytes Configuration bytes (Annex B byte stream).
+    /// @param[in,out] frame Frame to which the configuration is appended.
+    static void AppendConfig(const vector<BYTE> &configBytes,
+        vector<BYTE> &frame)
+    {
+        frame.insert(frame.end(), configBytes.begin(), configBytes.end());
+    }
+};
+
+///
+/// Output format where each NAL unit is preceded by its size as a 32-bit,
+/// big-endian integer, as in ISO/IEC 14496-15 ("avc1").
+struct LengthPrefixedFormat
+{
+    ///
+    /// Number of bytes in the NAL-unit size field.
+    static const size_t LENGTH_SIZE = 4;
+
+    ///
+    /// Begin a NAL unit in a frame.
+    ///
+    /// @param[in,out] frame Frame to which a placeholder size is appended.
+    /// @return Offset of the size field, to be passed to EndNalUnit.
+    static size_t BeginNalUnit(vector<BYTE> &frame)
+    {
+        size_t offset = frame.size();
+        frame.resize(offset + LENGTH_SIZE);
+        return offset;
+    }
+
+    ///
+    /// Finish a NAL unit started with BeginNalUnit by filling in its size.
+    ///
+    /// @param[in,out] frame Frame containing the NAL unit.
+    /// @param[in] offset Offset returned by BeginNalUnit.
+    static void EndNalUnit(vector<BYTE> &frame, size_t offset)
+    {
+        assert(frame.size() >= offset + LENGTH_SIZE);
+
+        size_t length = frame.size() - offset - LENGTH_SIZE;
+        frame[offset] = static_cast<BYTE>(length >> 24);
+        frame[offset + 1] = static_cast<BYTE>(length >> 16);
+        frame[offset + 2] = static_cast<BYTE>(length >> 8);
+        frame[offset + 3] = static_cast<BYTE>(length);
+    }
+
+    ///
+    /// Append configuration bytes from the SDP line, a=fmtp, to a frame.
+    ///
+    /// @note The configuration bytes are an Annex B byte stream, so each
+    /// start-code prefix is replaced with a size.
+    ///
+    /// @param[in] configBytes Configuration bytes (Annex B byte stream).
+    /// @param[in,out] frame Frame to which the configuration is appended.
+    static void AppendConfig(const vector<BYTE> &configBytes,
+        vector<BYTE> &frame)
+    {
+        static const size_t npos = static_cast<size_t>(-1);
+        size_t begin = npos;
+        size_t i = 0;
+        while (i + 3 <= configBytes.size())
+        {
+            if (configBytes[i] == 0x00 && configBytes[i + 1] == 0x00 &&
+                configBytes[i + 2] == 0x01)
+            {
+                if (begin != npos)
+                {
+                    AppendNalUnit(configBytes, begin, i, frame);
+                }
+                i += 3;
+                begin = i;
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        if (begin != npos)
+        {
+            AppendNalUnit(configBytes, begin, configBytes.size(), frame);
+        }
+    }
+
+private:
+    ///
+    /// Append one NAL unit, less any trailing zero bytes that belong to the
+    /// next start-code prefix, to a frame.
+    static void AppendNalUnit(const vector<BYTE> &bytes, size_t begin,
+        size_t end, vector<BYTE> &frame)
+    {
+        while (end > begin && bytes[end - 1] == 0x00)
+        {
+            --end;
+        }
+        if (end > begin)
+        {
+            size_t offset = BeginNalUnit(frame);
+            frame.insert(frame.end(), bytes.begin() + begin,
+                bytes.begin() + end);
+            EndNalUnit(frame, offset);
+        }
+    }
+};
+
+///
+/// The fields of an H.264 sequence parameter set that we use.
+struct H264SequenceParameterSet
+{
+    H264SequenceParameterSet();
+
+    ///
+    /// Parse a sequence parameter set as far as the frame size.
+    ///
+    /// @param[in,out] bin Bit stream positioned at the NAL-unit header.
+    /// @return Whether the fields were parsed.
+    bool Parse(ibitstream &bin);
+
+    ///
+    /// Frame size in pixels.
+    int width;
+    int height;
+
+    ///
+    /// log2_max_frame_num_minus4 + 4.
+    unsigned log2MaxFrameNum;
+
+    ///
+    /// separate_colour_plane_flag.
+    bool separateColourPlane;
+};
+
+///
+/// How much an H.264 frame matters to the frames after it.
+enum H264FrameClass
+{
+    H264_IDR_FRAME = 0,
+    H264_REFERENCE_FRAME = 1,
+    H264_NON_REFERENCE_FRAME = 2,
+    H264_FRAME_CLASSES = 3
+};
+
+///
+/// Decide which H.264 frames to drop when the host can't keep up.
+///
+/// @note Each VCL NAL unit is classified from nal_ref_idc, nal_unit_type and
+/// the start of its slice header (first_mb_in_slice, slice_type, frame_num).
+/// The decision is made at the first slice of a picture and applies to the
+/// rest of its slices.
+///
+/// @note As the reported queue depth grows, we first drop non-reference
+/// frames, which nothing else depends on, then reference frames. Once a
+/// reference frame is dropped, the frames after it can't be decoded, so we
+/// keep dropping until the next IDR frame, which is never dropped. The queue
+/// depths at which we start dropping scale with the stream's priority.
+///
+/// @note SetPriority and ReportQueueDepth may be called from any thread.
+/// Everything else must be called on the thread that receives the stream.
+class H264LoadShedder
 {
 public:
+    H264LoadShedder();
+
     ///
-    /// Get FOURCC representing video format on this stream.
+    /// Set what we need from the sequence parameter set to find frame_num.
     ///
-    /// @return FOURCC for video stream.
-    DWORD GetFOURCC() const;
+    /// @param[in] log2MaxFrameNum log2_max_frame_num_minus4 + 4.
+    /// @param[in] separateColourPlane separate_colour_plane_flag.
+    void SetSequenceParameters(unsigned log2MaxFrameNum,
+        bool separateColourPlane);
 
     ///
-    /// Get MIME subtype for this encoding.
+    /// Take the sequence parameters from a sequence parameter set received
+    /// in-band, which may differ from the one in the SDP.
     ///
-    /// @return MIME subtype.
-    const string &GetMimeSubtypeName() const;
+    /// @param[in] nalUnit Sequence parameter set, starting with the NAL-unit
+    /// header.
+    /// @param[in] length Number of bytes at nalUnit.
+    void OnSequenceParameterSet(const BYTE *nalUnit, size_t length);
 
     ///
-    /// Determine whether this packet contains the last part of a frame.
+    /// Set the priority of this stream.
     ///
-    /// @param[in] packet RTP packet.
-    /// @return Whether this is an end-of-frame packet.
-    bool EndOfFrame(RTPPacket *packet) const;
+    /// @param[in] priority 1 for the lowest priority; a stream with priority
+    /// n tolerates n times the queue depth before dropping frames.
+    void SetPriority(unsigned priority);
 
     ///
-    /// Extract one or more partial frames with the same timestamp.
+    /// Report the number of frames waiting to be processed downstream.
     ///
-    /// @note A frame is composed of a sequence of parts with the same
-    /// timestamp and is usually fragmented across mutiple RTP packets.
+    /// @param[in] depth Queue depth.
+    void ReportQueueDepth(size_t depth);
+
     ///
-    /// @param[in] packet RTP packet.
-    /// @param[in] marker Whether marker bit was set in RTP header (unused).
-    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
-    /// @param[in,out] frame Video frame under construction.
-    /// @param[out] fullFrame Whether the entire frame has been read.
-    /// @param[out] keyFrame Whether this is a keyframe.
-    void ExtractFrame(RTPPacket *packet, bool marker,
-        const vector<BYTE> &configBytes, vector<BYTE> &frame, bool &fullFrame,
-        bool &keyFrame);
+    /// Determine whether to drop a NAL unit.
+    ///
+    /// @note Only VCL NAL units are ever dropped.
+    ///
+    /// @param[in] nal_ref_idc nal_ref_idc from the NAL-unit header.
+    /// @param[in] nal_unit_type nal_unit_type from the NAL-unit header.
+    /// @param[in] sliceHeader Bytes following the NAL-unit header.
+    /// @param[in] length Number of bytes at sliceHeader.
+    /// @return Whether to drop the NAL unit.
+    bool Shed(BYTE nal_ref_idc, BYTE nal_unit_type, const BYTE *sliceHeader,
+        size_t length);
 
     ///
-    /// Construct media sample containing compressed frame.
+    /// Get the number of pictures dropped.
     ///
-    /// @param[in] Begin Beginning of the compressed frame.
-    /// @param[in] End One past the end of the compressed frame.
-    /// @param[in] keyFrame Whether this is a keyframe.
-    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
-    /// @param[in] source Reference back to containing RTSPSource.
-    /// @param[in,out] got_keyframe Whether an keyframe has been encountered yet (unused).
-    /// @param[out] sample Where sample is constructed.
-    /// @return Whether the sample was constructed.
-    bool ConstructMediaSample(const BYTE *Begin, const BYTE *End,
-        bool keyFrame, const vector<BYTE> &configBytes,
-        const RTSPSource &source, bool &got_keyframe,
-        CComPtr<IMediaSample> &sample) const;
+    /// @param[in] frameClass Class of the pictures.
+    /// @return Count.
+    unsigned long GetShedCount(H264FrameClass frameClass) const;
 
 protected:
     ///
-    /// Parse line containing SDP fmtp attribute.
+    /// Classify a slice from its NAL-unit header and slice header.
     ///
-    /// @post config is non-empty if returns true, empty if false.
+    /// @param[in] nal_ref_idc nal_ref_idc from the NAL-unit header.
+    /// @param[in] nal_unit_type nal_unit_type from the NAL-unit header.
+    /// @param[in] sliceHeader Bytes following the NAL-unit header.
+    /// @param[in] length Number of bytes at sliceHeader.
+    /// @param[out] firstSlice Whether this is the first slice of a picture.
+    /// @param[out] frameNum frame_num, if known.
+    /// @return Class of the picture to which the slice belongs.
+    H264FrameClass Classify(BYTE nal_ref_idc, BYTE nal_unit_type,
+        const BYTE *sliceHeader, size_t length, bool &firstSlice,
+        unsigned &frameNum) const;
+
     ///
-    /// @param[in] line Line containing the fmtp attribute.
-    /// @param[out] config Configuration bytes.
-    /// @return Whether the fmtp attribute was parsed.
-    bool ParseFmtp(const string &line, vector<BYTE> &config) const;
+    /// Queue depth per unit of priority at which to drop non-reference
+    /// frames.
+    static const size_t NON_REFERENCE_QUEUE_DEPTH = 4;
 
     ///
-    /// Parse a config string from an RTSP header.
+    /// Queue depth per unit of priority at which to drop reference frames.
+    static const size_t REFERENCE_QUEUE_DEPTH = 8;
+
     ///
-    /// @param bytes[in] Config bytes.
-    /// @param width[out] Receives video width.
-    /// @param height[out] Receives video height.
-    /// @param frameRate[out] Frames per second. Not used.
-    /// @return true if successful.
-    bool ParseConfig(const vector<BYTE> &bytes, int &width, int &height,
-        double &frameRate) const;
+    /// log2_max_frame_num_minus4 + 4, or 0 if unknown.
+    unsigned m_log2MaxFrameNum;
+
+    bool m_separateColourPlane;
+
+    ///
+    /// Priority and queue depth, which other threads set.
+    ///
+    /// @note Accessed only with interlocked operations.
+    volatile LONG m_priority;
+    volatile LONG m_queueDepth;
+
+    ///
+    /// Whether to drop every frame until the next IDR frame.
+    bool m_awaitingIdr;
+
+    ///
+    /// Whether the current picture is being dropped, and its frame_num.
+    bool m_shedding;
+    unsigned m_frameNum;
+
+    unsigned long m_shedCounts[H264_FRAME_CLASSES];
+};
+
+///
+/// Build frames out of NAL units in one of the output formats.
+///
+/// @note This is what the H264Depacketizer specializations have in common.
+template <class OutputFormat>
+class H264FrameAssembler
+{
+public:
+    ///
+    /// Get the RTP timestamp of the most recently started frame or, in
+    /// interleaved mode, the most recently extracted one.
+    ///
+    /// @return RTP timestamp.
+    DWORD GetFrameTimestamp() const { return m_frameTimestamp; }
+
+    ///
+    /// Get the RTP timestamp of the packet that carried the start of that
+    /// frame.
+    ///
+    /// @note Differs from GetFrameTimestamp only for NAL units in MTAPs,
+    /// whose timestamps are offset from the packet's. Use this one to look up
+    /// when the frame arrived.
+    ///
+    /// @return RTP timestamp.
+    DWORD GetArrivalTimestamp() const { return m_arrivalTimestamp; }
+
+    ///
+    /// Set the policy for dropping frames under load.
+    ///
+    /// @param[in] shedder Load shedder, or NULL to keep every frame. Not
+    /// owned; must outlive this object.
+    void SetLoadShedder(H264LoadShedder *shedder) { m_shedder = shedder; }
+
+protected:
+    H264FrameAssembler() :
+        m_nalUnitOffset(0), m_frameTimestamp(0), m_arrivalTimestamp(0),
+        m_shedder(NULL) {}
+
+    ///
+    /// Determine whether to ignore a NAL unit whatever the load.
+    ///
+    /// @note Non-VCL NAL units whose nal_ref_idc is 0 are ignored; see
+    /// H264Depacketizer::ExtractFrame. Non-reference slices are not: the
+    /// load shedder decides what happens to them.
+    ///
+    /// @param[in] nal_ref_idc nal_ref_idc from the NAL-unit header.
+    /// @param[in] nal_unit_type nal_unit_type from the NAL-unit header.
+    /// @return Whether to ignore the NAL unit.
+    static bool Ignore(BYTE nal_ref_idc, BYTE nal_unit_type)
+    {
+        return nal_ref_idc == 0 &&
+            (nal_unit_type < NAL_UT_SLICE || nal_unit_type > NAL_UT_IDR_SLICE);
+    }
+
+    ///
+    /// Determine whether to drop a NAL unit because of load.
+    ///
+    /// @param[in] nal_ref_idc nal_ref_idc from the NAL-unit header.
+    /// @param[in] nal_unit_type nal_unit_type from the NAL-unit header.
+    /// @param[in] sliceHeader Bytes following the NAL-unit header.
+    /// @param[in] length Number of bytes at sliceHeader.
+    /// @return Whether to drop the NAL unit.
+    bool Shed(BYTE nal_ref_idc, BYTE nal_unit_type, const BYTE *sliceHeader,
+        size_t length)
+    {
+        return m_shedder != NULL &&
+            m_shedder->Shed(nal_ref_idc, nal_unit_type, sliceHeader, length);
+    }
+
+    ///
+    /// Start a new frame.
+    ///
+    /// @post frame contains the configuration bytes, if an IDR frame, followed
+    /// by any in-band parameter sets; m_inBandParameterSets is empty.
+    ///
+    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
+    /// @param[in] idr Whether the frame is an IDR frame.
+    /// @param[in] timestamp RTP timestamp of the frame.
+    /// @param[out] frame Video frame under construction.
+    void BeginFrame(const vector<BYTE> &configBytes, bool idr,
+        DWORD timestamp, vector<BYTE> &frame);
 
     ///
     /// Save picture/sequence parameter set.
     ///
-    /// @pre set is not empty.
+    /// @note Sequence parameter sets also go to the load shedder, if any.
+    ///
+    /// @pre [begin, end) is not empty.
     /// @post m_inBandParameterSets is not empty.
     ///
-    /// @param[in] set BYTE vector containing a picture or sequence parameter set.
-    void SaveInBandParameterSet(const vector<BYTE> &set);
+    /// @param[in] begin Beginning of the picture or sequence parameter set.
+    /// @param[in] end One past the end of the parameter set.
+    void SaveInBandParameterSet(const BYTE *begin, const BYTE *end);
 
     ///
     /// Append picture and sequence parameter sets received since previous frame after prepending NAL-unit prefix to each.
@@ -226,6 +562,22 @@ protected:
     /// 68210e0fc800
     list<vector<BYTE> > m_inBandParameterSets;
 
+    ///
+    /// Offset of the NAL unit being reassembled from fragmentation units.
+    ///
+    /// @note Passed to OutputFormat::EndNalUnit when the end fragment arrives.
+    size_t m_nalUnitOffset;
+
+    ///
+    /// RTP timestamp of the frame under construction, and of the packet that
+    /// carried its start.
+    DWORD m_frameTimestamp;
+    DWORD m_arrivalTimestamp;
+
+    ///
+    /// Policy for dropping frames under load, or NULL.
+    H264LoadShedder *m_shedder;
+
     ///
     /// Maximum number of picture/sequence parameter sets we save.
     ///
@@ -238,3 +590,1468 @@ protected:
     /// frames, I suppose we could temporarilly have a few more.
     static const size_t MAXIMUM_IN_BAND_PARAMETER_SETS = 10;
 };
+
+///
+/// Reassemble H.264 frames from RTP payloads.
+///
+/// @note The packetization mode and output format never change during a
+/// session, so they are template parameters rather than run-time state. The
+/// compiler folds away the NAL-unit types the mode doesn't permit and inlines
+/// the output format, leaving a per-packet path with no virtual calls and no
+/// branches beyond the ones on the payload itself. RTSPUDPH264 is a thin
+/// adapter from the RTSPUDPEncoding interface onto an instance of this class.
+///
+/// @note Packet may be any type with GetPayloadData, GetPayloadLength and
+/// GetTimestamp members, such as RTPPacket.
+template <H264PacketizationMode Mode, class OutputFormat>
+class H264Depacketizer : public H264FrameAssembler<OutputFormat>
+{
+public:
+    H264Depacketizer() : m_shedding(false) {}
+
+    ///
+    /// Determine whether this packet contains the last part of a frame.
+    ///
+    /// @param[in] packet RTP packet.
+    /// @return Whether this is an end-of-frame packet.
+    template <class Packet>
+    static bool EndOfFrame(Packet *packet);
+
+    ///
+    /// Extract one or more partial frames with the same timestamp.
+    ///
+    /// @note A frame is composed of a sequence of parts with the same
+    /// timestamp and is usually fragmented across mutiple RTP packets.
+    ///
+    /// @param[in] packet RTP packet.
+    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
+    /// @param[in,out] frame Video frame under construction.
+    /// @param[out] fullFrame Whether the entire frame has been read.
+    /// @param[out] keyFrame Whether this is a keyframe.
+    template <class Packet>
+    void ExtractFrame(Packet *packet, const vector<BYTE> &configBytes,
+        vector<BYTE> &frame, bool &fullFrame, bool &keyFrame);
+
+protected:
+    ///
+    /// Whether the NAL unit being reassembled from fragmentation units is
+    /// being dropped because of load.
+    bool m_shedding;
+};
+
+template <H264PacketizationMode Mode, class OutputFormat>
+template <class Packet>
+inline bool
+H264Depacketizer<Mode, OutputFormat>::
+EndOfFrame(Packet *packet)
+{
+    assert(packet != NULL);
+
+    bool end = false;
+
+    // For H.264, we need to wade into the payload to determine end of frame.
+    // (The RTP marker bit is also set, just like MPEG4; however, the standard
+    // for RTP H.264 packetization, RFC3984, says, don't rely on that.)
+    const BYTE *payload = packet->GetPayloadData();
+    size_t payloadLength = packet->GetPayloadLength();
+
+    // Payload header: forbidden_zero_bit (1), nal_ref_idc (2), type (5).
+    if (payloadLength >= 2)
+    {
+        switch (payload[0] & 0x1F)
+        {
+        case NAL_UT_FU_A:
+        // (We don't support B, but end bit applies to this type, too.)
+        case NAL_UT_FU_B:
+            // Fragmentation units aren't allowed in single NAL unit mode.
+            if (Mode != H264_SINGLE_NAL_UNIT_MODE &&
+                !H264Depacketizer::Ignore((payload[0] >> 5) & 0x03,
+                    payload[1] & 0x1F))
+            {
+                end = (payload[1] & 0x40) != 0;
+            }
+            break;
+
+        default:
+            // Do nothing.
+            break;
+        }
+    }
+
+    return end;
+}
+
+template <H264PacketizationMode Mode, class OutputFormat>
+template <class Packet>
+inline void
+H264Depacketizer<Mode, OutputFormat>::
+ExtractFrame(Packet *packet, const vector<BYTE> &configBytes,
+    vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+{
+    assert(packet != NULL);
+
+    const BYTE *payload = packet->GetPayloadData();
+    size_t payloadLength = packet->GetPayloadLength();
+
+    // Payload header: forbidden_zero_bit (1), nal_ref_idc (2), type (5).
+    const BYTE nal_ref_idc = payloadLength != 0 ? (payload[0] >> 5) & 0x03 : 0;
+    const BYTE fragmentation_unit_type = payloadLength != 0 ?
+        payload[0] & 0x1F : 0;
+
+    // Type of the NAL unit itself, from the FU header for fragmentation
+    // units.
+    const BYTE nal_unit_type = (fragmentation_unit_type == NAL_UT_FU_A ||
+        fragmentation_unit_type == NAL_UT_FU_B) && payloadLength >= 2 ?
+        payload[1] & 0x1F : fragmentation_unit_type;
+
+    // Ignore all non-VCL NAL units where NRI, or nal_ref_idc, is 0.
+    //
+    // We primarily do this because the SEI packets from some cameras cause
+    // the UMC H.264 decoder we use to throw an exception. This is safe to do
+    // because, from RFC3984: "nal_ref_idc. ... a value of 00 indicates that
+    // the content of the NAL unit is not used to reconstruct reference
+    // pictures for inter picture prediction. Such NAL units can be discarded
+    // without risking the integrity of the reference pictures." and
+    // "Intelligent receivers having to discard packets or NALUs should first
+    // discard all packets/NALUs in which the value of the NRI field of the NAL
+    // unit type octet is equal to 0. This will minimize the impact on user
+    // experience and keep the reference pictures intact."
+    //
+    // Non-reference slices, though, go to the load shedder, which drops them
+    // first when we fall behind and keeps them when we don't.
+    if (!this->Ignore(nal_ref_idc, nal_unit_type))
+    {
+        switch (fragmentation_unit_type)
+        {
+        case NAL_UT_FU_A:
+            // Not allowed for packetization-mode=0; the compiler drops this
+            // case entirely for that mode.
+            if (Mode != H264_SINGLE_NAL_UNIT_MODE && payloadLength >= 2)
+            {
+                const bool start_fragment = (payload[1] & 0x80) != 0;
+                const bool end_fragment = (payload[1] & 0x40) != 0;
+
+                // If we drop the first fragment, drop the rest, too.
+                if (start_fragment)
+                {
+                    m_shedding = this->Shed(nal_ref_idc, nal_unit_type,
+                        payload + 2, payloadLength - 2);
+                }
+                if (m_shedding)
+                {
+                    m_shedding = !end_fragment;
+                    break;
+                }
+
+                if (start_fragment || frame.empty())
+                {
+                    // Should never have start bit set while already
+                    // assembling frame. BeginFrame clears frame just to be
+                    // sure.
+                    this->BeginFrame(configBytes,
+                        nal_unit_type == NAL_UT_IDR_SLICE,
+                        packet->GetTimestamp(), frame);
+
+                    this->m_nalUnitOffset = OutputFormat::BeginNalUnit(frame);
+
+                    // NRI + NAL type tells decoder type of NAL unit.
+                    frame.push_back(static_cast<BYTE>(
+                        (nal_ref_idc << 5) | nal_unit_type));
+                }
+
+                // Append fragments without FU-indicator- and FU-header-bytes.
+                frame.insert(frame.end(), payload + 2, payload + payloadLength);
+
+                // (If end fragment, RTP marker bit should also be set. The
+                // former is more reliable, though, according to RFC 3894.)
+                if (end_fragment)
+                {
+                    OutputFormat::EndNalUnit(frame, this->m_nalUnitOffset);
+
+                    if (nal_unit_type == NAL_UT_IDR_SLICE)
+                    {
+                        keyFrame = true;
+                    }
+
+                    fullFrame = true;
+                }
+            }
+            break;
+
+        case NAL_UT_STAP_A:
+            // TBD - Supposed to support for packetization-mode=1. Ignore for
+            // now (we haven't encountered from any cameras).
+            break;
+
+        case NAL_UT_STAP_B:
+        case NAL_UT_MTAP16:
+        case NAL_UT_MTAP24:
+        case NAL_UT_FU_B:
+            // Not allowed for packetization-mode=0 or 1 (non-interleaved).
+            // See the H264_INTERLEAVED_MODE specialization.
+            break;
+
+        case NAL_UT_SPS:
+        case NAL_UT_PPS:
+            // Save parameter set (without RTP header) for subsequent inclusion
+            // with next frame.
+            this->SaveInBandParameterSet(payload, payload + payloadLength);
+            break;
+
+        default:
+        {
+            // A non-fragmentation-unit should never appear with fragmentation
+            // units. We could assert(frame.empty()). Instead, to gracefully
+            // handle this error, BeginFrame just makes sure we're not
+            // appending this NAL unit to others.
+            //
+            // An IDR slice is inherently a key frame, so prime decoder(s) with
+            // SPS & PPS data.
+            if (this->Shed(nal_ref_idc, fragmentation_unit_type, payload + 1,
+                payloadLength - 1))
+            {
+                break;
+            }
+
+            const bool idr = fragmentation_unit_type == NAL_UT_IDR_SLICE;
+            this->BeginFrame(configBytes, idr, packet->GetTimestamp(), frame);
+
+            // Append entire payload (no FU header bytes to ignore).
+            size_t offset = OutputFormat::BeginNalUnit(frame);
+            frame.insert(frame.end(), payload, payload + payloadLength);
+            OutputFormat::EndNalUnit(frame, offset);
+
+            if (idr)
+            {
+                keyFrame = true;
+            }
+
+            fullFrame = true;
+            break;
+        }
+        }
+    }
+}
+
+template <class OutputFormat>
+inline void
+H264FrameAssembler<OutputFormat>::
+BeginFrame(const vector<BYTE> &configBytes, bool idr, DWORD timestamp,
+    vector<BYTE> &frame)
+{
+    frame.clear();
+
+    m_frameTimestamp = timestamp;
+    m_arrivalTimestamp = timestamp;
+
+    if (idr)
+    {
+        OutputFormat::AppendConfig(configBytes, frame);
+    }
+
+    // Append any picture or sequence parameter sets received since previous
+    // frame.
+    if (!m_inBandParameterSets.empty())
+    {
+        AppendInBandParameterSets(frame);
+    }
+
+    assert(m_inBandParameterSets.empty());
+}
+
+template <class OutputFormat>
+void
+H264FrameAssembler<OutputFormat>::
+SaveInBandParameterSet(const BYTE *begin, const BYTE *end)
+{
+    assert(begin != end);
+
+    // Assure there will be room for this, new parameter set.
+    while (m_inBandParameterSets.size() >= MAXIMUM_IN_BAND_PARAMETER_SETS)
+    {
+        m_inBandParameterSets.pop_front();
+    }
+
+    m_inBandParameterSets.push_back(vector<BYTE>(begin, end));
+
+    // (The camera may change resolution or GOP structure mid-stream.)
+    if ((*begin & 0x1F) == NAL_UT_SPS && m_shedder != NULL)
+    {
+        m_shedder->OnSequenceParameterSet(begin, end - begin);
+    }
+
+    assert(!m_inBandParameterSets.empty());
+    assert(m_inBandParameterSets.size() <= MAXIMUM_IN_BAND_PARAMETER_SETS);
+}
+
+template <class OutputFormat>
+void
+H264FrameAssembler<OutputFormat>::
+AppendInBandParameterSets(vector<BYTE> &frame)
+{
+    assert(!m_inBandParameterSets.empty());
+
+    BOOST_FOREACH(const vector<BYTE> &set, m_inBandParameterSets)
+    {
+        size_t offset = OutputFormat::BeginNalUnit(frame);
+
+        frame.insert(frame.end(), set.begin(), set.end());
+
+        OutputFormat::EndNalUnit(frame, offset);
+    }
+
+    m_inBandParameterSets.clear();
+
+    assert(m_inBandParameterSets.empty());
+    assert(!frame.empty());
+}
+
+///
+/// Decoding-order-number (DON) reorder buffer for the interleaved
+/// packetization mode.
+///
+/// @note NAL units are copied into a fixed pool of slots allocated by
+/// Configure. A slot's buffer keeps its capacity when the slot is reused, so
+/// once the pool has warmed up, buffering a NAL unit doesn't touch the heap.
+///
+/// @note We hold NAL units until more VCL NAL units are buffered than
+/// sprop-interleaving-depth allows or until the buffered DONs span more than
+/// sprop-max-don-diff, then release them lowest DON first. NAL units that
+/// arrive after a NAL unit with the same or a higher DON has been released
+/// are too late to be decoded in order and are discarded. If the pool fills
+/// up first, the caller must release NAL units early to make room.
+///
+/// @note The buffered slots are kept in a heap ordered by DON, and the
+/// highest DON is tracked as NAL units arrive, so finding what to release
+/// next takes constant time and releasing it logarithmic time.
+class H264Deinterleaver
+{
+public:
+    ///
+    /// One NAL unit in the pool.
+    struct Slot
+    {
+        WORD don;
+
+        ///
+        /// RTP timestamp of the NAL unit, and of the packet that carried it.
+        DWORD timestamp;
+        DWORD packetTimestamp;
+
+        vector<BYTE> nalUnit;
+    };
+
+    H264Deinterleaver();
+
+    ///
+    /// Set the interleaving parameters and discard anything buffered.
+    ///
+    /// @param[in] interleavingDepth Value of sprop-interleaving-depth.
+    /// @param[in] maxDonDiff Value of sprop-max-don-diff, or
+    /// UNLIMITED_DON_DIFF if not present.
+    void Configure(size_t interleavingDepth, size_t maxDonDiff);
+
+    ///
+    /// Start buffering a NAL unit.
+    ///
+    /// @note Any NAL unit begun but not ended is discarded.
+    ///
+    /// @pre !IsFull() or InNalUnit().
+    ///
+    /// @param[in] don Decoding order number.
+    /// @param[in] timestamp RTP timestamp of the NAL unit.
+    /// @param[in] packetTimestamp RTP timestamp of the packet carrying it.
+    /// @return Buffer to which the caller appends the NAL unit, or NULL if the
+    /// NAL unit is too late (or, defensively, if there's no room for it).
+    vector<BYTE> *BeginNalUnit(WORD don, DWORD timestamp,
+        DWORD packetTimestamp);
+
+    ///
+    /// Whether a NAL unit has been begun but not ended.
+    bool InNalUnit() const { return m_current != NO_SLOT; }
+
+    ///
+    /// Get the buffer for the NAL unit begun but not ended.
+    ///
+    /// @pre InNalUnit().
+    vector<BYTE> &CurrentNalUnit();
+
+    ///
+    /// Add the NAL unit begun with BeginNalUnit to the reorder buffer.
+    ///
+    /// @pre InNalUnit().
+    /// @post !InNalUnit().
+    void EndNalUnit();
+
+    ///
+    /// Discard the NAL unit begun with BeginNalUnit, e.g., on packet loss.
+    ///
+    /// @post !InNalUnit().
+    void AbortNalUnit();
+
+    ///
+    /// Determine whether the NAL unit with the lowest DON must be released.
+    bool MustRelease() const;
+
+    ///
+    /// Whether every slot in the pool is in use, so that the NAL unit with
+    /// the lowest DON must be released before another can be begun.
+    bool IsFull() const { return m_free.empty(); }
+
+    ///
+    /// Get the buffered NAL unit with the lowest DON.
+    ///
+    /// @pre The reorder buffer is not empty.
+    ///
+    /// @return Slot holding the NAL unit, valid until PopFront.
+    const Slot &Front() const;
+
+    ///
+    /// Release the buffered NAL unit with the lowest DON.
+    ///
+    /// @pre The reorder buffer is not empty.
+    void PopFront();
+
+    ///
+    /// Value passed to Configure when sprop-max-don-diff is not present.
+    static const size_t UNLIMITED_DON_DIFF = 32767;
+
+protected:
+    ///
+    /// Distance in decoding order from DON m to DON n, modulo 2^16.
+    static int DonDiff(WORD m, WORD n);
+
+    ///
+    /// Heap order for m_buffered: the slot with the lowest DON on top.
+    class LaterDon
+    {
+    public:
+        explicit LaterDon(const vector<Slot> &slots) : m_slots(&slots) {}
+
+        bool operator()(size_t i, size_t j) const
+        {
+            return DonDiff((*m_slots)[j].don, (*m_slots)[i].don) > 0;
+        }
+
+    private:
+        const vector<Slot> *m_slots;
+    };
+
+    static const size_t NO_SLOT = static_cast<size_t>(-1);
+
+    ///
+    /// Largest sprop-interleaving-depth we honor.
+    ///
+    /// @note Bounds the pool for streams that advertise unreasonable depths.
+    static const size_t MAXIMUM_INTERLEAVING_DEPTH = 256;
+
+    ///
+    /// Slots beyond the interleaving depth, for the NAL units of the packet
+    /// that pushes the buffer over the depth.
+    static const size_t EXTRA_SLOTS = 32;
+
+    size_t m_interleavingDepth;
+    size_t m_maxDonDiff;
+
+    ///
+    /// Pool of slots, allocated by Configure.
+    vector<Slot> m_slots;
+
+    ///
+    /// Indices of unused slots.
+    vector<size_t> m_free;
+
+    ///
+    /// Indices of slots in the reorder buffer, as a heap ordered by LaterDon.
+    vector<size_t> m_buffered;
+
+    ///
+    /// Highest DON in the reorder buffer, if it isn't empty.
+    WORD m_highestDon;
+
+    ///
+    /// Number of VCL NAL units in the reorder buffer.
+    size_t m_vclNalUnits;
+
+    ///
+    /// Index of the slot begun with BeginNalUnit, or NO_SLOT.
+    size_t m_current;
+
+    ///
+    /// DON of the most recently released NAL unit.
+    WORD m_releasedDon;
+
+    ///
+    /// Whether any NAL unit has been released since Configure.
+    bool m_released;
+};
+
+///
+/// Reassemble H.264 frames from RTP payloads in interleaved mode
+/// (packetization-mode=2).
+///
+/// @note NAL units come from STAP-B, MTAP16, MTAP24 and FU-B/FU-A packets,
+/// each carrying a decoding order number, and go through an H264Deinterleaver
+/// before they're assembled into frames. A frame is a run of NAL units
+/// released by one packet that share an RTP timestamp. One packet can release
+/// several frames; ExtractFrame returns the first and ExtractPendingFrame the
+/// rest. Whatever the caller doesn't extract before the next packet is
+/// dropped, so pending frames never pile up.
+template <class OutputFormat>
+class H264Depacketizer<H264_INTERLEAVED_MODE, OutputFormat> :
+    public H264FrameAssembler<OutputFormat>
+{
+public:
+    H264Depacketizer() : m_frameOpen(false), m_droppedFrames(0) {}
+
+    ///
+    /// Set the interleaving parameters from the SDP line, a=fmtp, and discard
+    /// anything buffered.
+    ///
+    /// @param[in] interleavingDepth Value of sprop-interleaving-depth.
+    /// @param[in] maxDonDiff Value of sprop-max-don-diff, or
+    /// H264Deinterleaver::UNLIMITED_DON_DIFF if not present.
+    void Configure(size_t interleavingDepth, size_t maxDonDiff)
+    {
+        m_deinterleaver.Configure(interleavingDepth, maxDonDiff);
+        m_spareFrames.splice(m_spareFrames.end(), m_pendingFrames);
+        m_frameOpen = false;
+    }
+
+    ///
+    /// Determine whether this packet contains the last part of a frame.
+    ///
+    /// @param[in] packet RTP packet.
+    /// @return Whether this is an end-of-frame packet.
+    template <class Packet>
+    static bool EndOfFrame(Packet *packet);
+
+    ///
+    /// Extract one or more partial frames with the same timestamp.
+    ///
+    /// @param[in] packet RTP packet.
+    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
+    /// @param[in,out] frame Video frame under construction.
+    /// @param[out] fullFrame Whether the entire frame has been read.
+    /// @param[out] keyFrame Whether this is a keyframe.
+    template <class Packet>
+    void ExtractFrame(Packet *packet, const vector<BYTE> &configBytes,
+        vector<BYTE> &frame, bool &fullFrame, bool &keyFrame);
+
+    ///
+    /// Whether the last packet released more frames than ExtractFrame
+    /// returned.
+    bool HasPendingFrame() const { return !m_pendingFrames.empty(); }
+
+    ///
+    /// Get the next frame released by the last packet, if any.
+    ///
+    /// @param[out] frame Receives the frame, replacing what was there.
+    /// @param[out] fullFrame Whether a frame was extracted.
+    /// @param[out] keyFrame Whether this is a keyframe.
+    void ExtractPendingFrame(vector<BYTE> &frame, bool &fullFrame,
+        bool &keyFrame);
+
+    ///
+    /// Get the number of frames dropped because they were still pending
+    /// when the next packet arrived.
+    ///
+    /// @return Count.
+    unsigned long GetDroppedFrameCount() const { return m_droppedFrames; }
+
+protected:
+    ///
+    /// Buffer each NAL unit in an STAP-B, MTAP16 or MTAP24 packet.
+    ///
+    /// @param[in] payload RTP payload, starting with the payload header.
+    /// @param[in] payloadLength Length of payload in bytes.
+    /// @param[in] timestamp RTP timestamp of the packet.
+    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
+    void BufferAggregationPacket(const BYTE *payload, size_t payloadLength,
+        DWORD timestamp, const vector<BYTE> &configBytes);
+
+    ///
+    /// Buffer one NAL unit, unless it's to be ignored (see Ignore).
+    void BufferNalUnit(WORD don, DWORD timestamp, DWORD packetTimestamp,
+        const BYTE *nalUnit, size_t length, const vector<BYTE> &configBytes);
+
+    ///
+    /// Add the NAL unit begun with H264Deinterleaver::BeginNalUnit to the
+    /// reorder buffer and release whatever must be.
+    void EndNalUnit(const vector<BYTE> &configBytes);
+
+    ///
+    /// Move NAL units the deinterleaver releases into pending frames.
+    ///
+    /// @note Releases what the interleaving parameters call for and, so that
+    /// no NAL unit ever has to be discarded for lack of room, enough to leave
+    /// a slot free for the next one.
+    ///
+    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
+    void ReleaseNalUnits(const vector<BYTE> &configBytes);
+
+    H264Deinterleaver m_deinterleaver;
+
+    ///
+    /// A frame released by the deinterleaver but not yet extracted.
+    struct PendingFrame
+    {
+        vector<BYTE> frame;
+        DWORD timestamp;
+
+        ///
+        /// RTP timestamp of the packet that carried the first NAL unit.
+        DWORD arrivalTimestamp;
+
+        bool keyFrame;
+
+        ///
+        /// Whether frame starts with the configuration bytes.
+        bool primed;
+    };
+
+    ///
+    /// Frames released but not yet extracted, oldest first.
+    list<PendingFrame> m_pendingFrames;
+
+    ///
+    /// Extracted frames, kept so their nodes and buffers can be reused.
+    ///
+    /// @note Frames move between the lists by splicing, and extraction swaps
+    /// buffers with the caller, so nothing is copied or allocated once
+    /// the lists have warmed up.
+    list<PendingFrame> m_spareFrames;
+
+    ///
+    /// Whether NAL units released with the same timestamp can still join the
+    /// last pending frame, i.e., whether it was begun by the current packet.
+    bool m_frameOpen;
+
+    ///
+    /// Scratch buffer for the configuration bytes when an IDR NAL unit isn't
+    /// the first in its frame; reused to avoid allocating.
+    vector<BYTE> m_config;
+
+    ///
+    /// Number of pending frames dropped.
+    unsigned long m_droppedFrames;
+};
+
+template <class OutputFormat>
+template <class Packet>
+inline bool
+H264Depacketizer<H264_INTERLEAVED_MODE, OutputFormat>::
+EndOfFrame(Packet *packet)
+{
+    assert(packet != NULL);
+
+    bool end = false;
+
+    const BYTE *payload = packet->GetPayloadData();
+    size_t payloadLength = packet->GetPayloadLength();
+
+    // In interleaved mode, a fragmented NAL unit starts with an FU-B and
+    // continues with FU-As.
+    if (payloadLength >= 2)
+    {
+        switch (payload[0] & 0x1F)
+        {
+        case NAL_UT_FU_A:
+        case NAL_UT_FU_B:
+            if (!H264Depacketizer::Ignore((payload[0] >> 5) & 0x03,
+                payload[1] & 0x1F))
+            {
+                end = (payload[1] & 0x40) != 0;
+            }
+            break;
+
+        default:
+            // Do nothing.
+            break;
+        }
+    }
+
+    return end;
+}
+
+template <class OutputFormat>
+template <class Packet>
+inline void
+H264Depacketizer<H264_INTERLEAVED_MODE, OutputFormat>::
+ExtractFrame(Packet *packet, const vector<BYTE> &configBytes,
+    vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+{
+    assert(packet != NULL);
+
+    const BYTE *payload = packet->GetPayloadData();
+    size_t payloadLength = packet->GetPayloadLength();
+    DWORD timestamp = packet->GetTimestamp();
+
+    // Frames the caller didn't extract from the last packet are stale now.
+    // (Dropping them bounds the pending list at what one packet releases.)
+    if (!m_pendingFrames.empty())
+    {
+        m_droppedFrames += static_cast<unsigned long>(m_pendingFrames.size());
+        m_spareFrames.splice(m_spareFrames.end(), m_pendingFrames);
+    }
+
+    // (As in the other modes, ignore non-VCL NAL units where NRI is 0. The
+    // NAL units in aggregation packets are checked individually.)
+    if (payloadLength >= 2)
+    {
+        switch (payload[0] & 0x1F)
+        {
+        case NAL_UT_STAP_B:
+        case NAL_UT_MTAP16:
+        case NAL_UT_MTAP24:
+            BufferAggregationPacket(payload, payloadLength, timestamp,
+                configBytes);
+            break;
+
+        case NAL_UT_FU_B:
+            // FU indicator, FU header, DON, then the first fragment.
+            if (payloadLength >= 4 && (payload[1] & 0x80) != 0)
+            {
+                WORD don = static_cast<WORD>((payload[2] << 8) | payload[3]);
+                vector<BYTE> *nalUnit = NULL;
+                if (this->Ignore((payload[0] >> 5) & 0x03, payload[1] & 0x1F))
+                {
+                    // (Still ends any NAL unit begun before it, so its FU-As
+                    // aren't appended to that one.)
+                    m_deinterleaver.AbortNalUnit();
+                }
+                else
+                {
+                    nalUnit = m_deinterleaver.BeginNalUnit(don, timestamp,
+                        timestamp);
+                }
+                if (nalUnit != NULL)
+                {
+                    // NRI + NAL type tells decoder type of NAL unit.
+                    nalUnit->push_back(static_cast<BYTE>(
+                        (payload[0] & 0x60) | (payload[1] & 0x1F)));
+                    nalUnit->insert(nalUnit->end(), payload + 4,
+                        payload + payloadLength);
+                    if ((payload[1] & 0x40) != 0)
+                    {
+                        EndNalUnit(configBytes);
+                    }
+                }
+            }
+            break;
+
+        case NAL_UT_FU_A:
+            // Subsequent fragments of a NAL unit started by an FU-B. If we
+            // missed the FU-B, we don't know the DON, so drop the rest.
+            if (m_deinterleaver.InNalUnit())
+            {
+                if ((payload[1] & 0x80) != 0)
+                {
+                    m_deinterleaver.AbortNalUnit();
+                }
+                else
+                {
+                    vector<BYTE> &nalUnit = m_deinterleaver.CurrentNalUnit();
+                    nalUnit.insert(nalUnit.end(), payload + 2,
+                        payload + payloadLength);
+                    if ((payload[1] & 0x40) != 0)
+                    {
+                        EndNalUnit(configBytes);
+                    }
+                }
+            }
+            break;
+
+        default:
+            // Single NAL unit packets and STAP-A are not allowed for
+            // packetization-mode=2.
+            break;
+        }
+    }
+
+    // Frames don't span packets; the next packet's NAL units start a new one.
+    m_frameOpen = false;
+
+    ExtractPendingFrame(frame, fullFrame, keyFrame);
+}
+
+template <class OutputFormat>
+inline void
+H264Depacketizer<H264_INTERLEAVED_MODE, OutputFormat>::
+ExtractPendingFrame(vector<BYTE> &frame, bool &fullFrame, bool &keyFrame)
+{
+    if (!m_pendingFrames.empty())
+    {
+        PendingFrame &pending = m_pendingFrames.front();
+
+        // (The caller's buffer becomes a spare, so its capacity is reused.)
+        frame.swap(pending.frame);
+        this->m_frameTimestamp = pending.timestamp;
+        this->m_arrivalTimestamp = pending.arrivalTimestamp;
+        if (pending.keyFrame)
+        {
+            keyFrame = true;
+        }
+        fullFrame = true;
+
+        m_spareFrames.splice(m_spareFrames.end(), m_pendingFrames,
+            m_pendingFrames.begin());
+    }
+}
+
+template <class OutputFormat>
+void
+H264Depacketizer<H264_INTERLEAVED_MODE, OutputFormat>::
+BufferAggregationPacket(const BYTE *payload, size_t payloadLength,
+    DWORD timestamp, const vector<BYTE> &configBytes)
+{
+    const BYTE type = payload[0] & 0x1F;
+
+    // Bytes of DOND and TS offset preceding each NAL unit in an MTAP.
+    const size_t unitHeaderLength =
+        type == NAL_UT_MTAP16 ? 3 : type == NAL_UT_MTAP24 ? 4 : 0;
+
+    // STAP-B and MTAPs start with a 16-bit DON or DON base.
+    if (payloadLength >= 3)
+    {
+        const WORD don = static_cast<WORD>((payload[1] << 8) | payload[2]);
+        size_t offset = 3;
+        for (WORD i = 0; offset + 2 <= payloadLength; ++i)
+        {
+            // Size counts the NAL unit only, not an MTAP's DOND and TS offset.
+            const size_t size = (payload[offset] << 8) | payload[offset + 1];
+            offset += 2;
+            if (offset + unitHeaderLength + size > payloadLength)
+            {
+                break;
+            }
+
+            const BYTE *unit = payload + offset;
+            if (unitHeaderLength == 0)
+            {
+                // STAP-B: DONs are consecutive.
+                BufferNalUnit(static_cast<WORD>(don + i), timestamp,
+                    timestamp, unit, size, configBytes);
+            }
+            else
+            {
+                // MTAP: DON = DONB + DOND; NALU time = RTP time + TS offset.
+                DWORD offsetTime = (unit[1] << 8) | unit[2];
+                if (unitHeaderLength == 4)
+                {
+                    offsetTime = (offsetTime << 8) | unit[3];
+                }
+                BufferNalUnit(static_cast<WORD>(don + unit[0]),
+                    timestamp + offsetTime, timestamp, unit + unitHeaderLength,
+                    size, configBytes);
+            }
+
+            offset += unitHeaderLength + size;
+        }
+    }
+}
+
+template <class OutputFormat>
+inline void
+H264Depacketizer<H264_INTERLEAVED_MODE, OutputFormat>::
+BufferNalUnit(WORD don, DWORD timestamp, DWORD packetTimestamp,
+    const BYTE *nalUnit, size_t length, const vector<BYTE> &configBytes)
+{
+    if (length != 0 && !this->Ignore((nalUnit[0] >> 5) & 0x03,
+        nalUnit[0] & 0x1F))
+    {
+        vector<BYTE> *buffer =
+            m_deinterleaver.BeginNalUnit(don, timestamp, packetTimestamp);
+        if (buffer != NULL)
+        {
+            buffer->assign(nalUnit, nalUnit + length);
+            EndNalUnit(configBytes);
+        }
+    }
+}
+
+template <class OutputFormat>
+inline void
+H264Depacketizer<H264_INTERLEAVED_MODE, OutputFormat>::
+EndNalUnit(const vector<BYTE> &configBytes)
+{
+    m_deinterleaver.EndNalUnit();
+    ReleaseNalUnits(configBytes);
+
+    assert(!m_deinterleaver.IsFull());
+}
+
+template <class OutputFormat>
+void
+H264Depacketizer<H264_INTERLEAVED_MODE, OutputFormat>::
+ReleaseNalUnits(const vector<BYTE> &configBytes)
+{
+    while (m_deinterleaver.MustRelease() || m_deinterleaver.IsFull())
+    {
+        const H264Deinterleaver::Slot &front = m_deinterleaver.Front();
+        const vector<BYTE> &nalUnit = front.nalUnit;
+        const BYTE nal_unit_type = nalUnit[0] & 0x1F;
+
+        if (nal_unit_type == NAL_UT_SPS || nal_unit_type == NAL_UT_PPS)
+        {
+            // Save parameter set for subsequent inclusion with next frame.
+            this->SaveInBandParameterSet(&nalUnit[0],
+                &nalUnit[0] + nalUnit.size());
+        }
+        else if (this->Shed((nalUnit[0] >> 5) & 0x03, nal_unit_type,
+            &nalUnit[0] + 1, nalUnit.size() - 1))
+        {
+            // Dropped because of load.
+        }
+        else
+        {
+            const DWORD timestamp = front.timestamp;
+            const bool idr = nal_unit_type == NAL_UT_IDR_SLICE;
+
+            if (!m_frameOpen || m_pendingFrames.back().timestamp != timestamp)
+            {
+                if (m_spareFrames.empty())
+                {
+                    m_spareFrames.push_back(PendingFrame());
+                }
+                m_pendingFrames.splice(m_pendingFrames.end(), m_spareFrames,
+                    m_spareFrames.begin());
+
+                PendingFrame &pending = m_pendingFrames.back();
+                this->BeginFrame(configBytes, idr, timestamp, pending.frame);
+                pending.timestamp = timestamp;
+                pending.arrivalTimestamp = front.packetTimestamp;
+                pending.keyFrame = false;
+                pending.primed = idr;
+                m_frameOpen = true;
+            }
+
+            PendingFrame &pending = m_pendingFrames.back();
+            if (idr && !pending.primed)
+            {
+                // IDR slice after, e.g., an SEI; prime decoder(s) with SPS &
+                // PPS data.
+                m_config.clear();
+                OutputFormat::AppendConfig(configBytes, m_config);
+                pending.frame.insert(pending.frame.begin(), m_config.begin(),
+                    m_config.end());
+                pending.primed = true;
+            }
+
+            size_t offset = OutputFormat::BeginNalUnit(pending.frame);
+            pending.frame.insert(pending.frame.end(), nalUnit.begin(),
+                nalUnit.end());
+            OutputFormat::EndNalUnit(pending.frame, offset);
+
+            if (idr)
+            {
+                pending.keyFrame = true;
+            }
+        }
+
+        m_deinterleaver.PopFront();
+    }
+}
+
+///
+/// Histogram of latencies in power-of-two buckets.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    ///
+    /// Number of buckets.
+    ///
+    /// @note Bucket 0 counts latencies under 2 microseconds; bucket i > 0
+    /// counts latencies in [2^i, 2^(i+1)) microseconds; the last bucket also
+    /// counts everything longer.
+    static const size_t BUCKETS = 24;
+
+    ///
+    /// Count one latency.
+    ///
+    /// @param[in] latency Latency in 100-nanosecond units.
+    void Record(REFERENCE_TIME latency);
+
+    ///
+    /// Get the number of latencies counted in a bucket.
+    ///
+    /// @pre bucket < BUCKETS.
+    ///
+    /// @param[in] bucket Bucket index.
+    /// @return Count.
+    unsigned long GetCount(size_t bucket) const;
+
+protected:
+    unsigned long m_counts[BUCKETS];
+};
+
+///
+/// Map RTP timestamps on a stream to presentation times and keep the
+/// interarrival jitter.
+///
+/// @note Timestamps are extended to 64 bits so that the mapping survives the
+/// 32-bit RTP timestamp wrapping around (every 13 hours at 90 kHz).
+///
+/// @note Until an RTCP sender report arrives, presentation times are the RTP
+/// clock elapsed since the first packet. Once one arrives, they're the
+/// sender's wallclock (NTP) time elapsed since the first packet, so streams
+/// from the same sender line up. The first report doesn't move the origin;
+/// later ones correct for drift between the RTP clock and the wallclock.
+class RTPClock
+{
+public:
+    ///
+    /// Constructor.
+    ///
+    /// @param[in] clockRate RTP clock rate in Hz, e.g., 90000 for video.
+    explicit RTPClock(DWORD clockRate);
+
+    ///
+    /// Get the current time on the local clock used for arrival times.
+    ///
+    /// @return Current time in 100-nanosecond units.
+    static REFERENCE_TIME Now();
+
+    ///
+    /// Note the arrival of an RTP packet.
+    ///
+    /// @post GetJitter includes this packet, and GetFirstArrival finds this
+    /// packet's arrival if it is the first with its timestamp.
+    ///
+    /// @param[in] timestamp RTP timestamp of the packet.
+    /// @param[in] arrival Arrival time, on the same clock as Now.
+    void OnPacket(DWORD timestamp, REFERENCE_TIME arrival);
+
+    ///
+    /// Note an RTCP sender report.
+    ///
+    /// @param[in] ntpSeconds NTP timestamp, most significant word.
+    /// @param[in] ntpFraction NTP timestamp, least significant word.
+    /// @param[in] timestamp RTP timestamp corresponding to the NTP timestamp.
+    void OnSenderReport(DWORD ntpSeconds, DWORD ntpFraction, DWORD timestamp);
+
+    ///
+    /// Map an RTP timestamp to a presentation time.
+    ///
+    /// @param[in] timestamp RTP timestamp.
+    /// @return Presentation time in 100-nanosecond units.
+    REFERENCE_TIME GetPresentationTime(DWORD timestamp);
+
+    ///
+    /// Get the arrival time of the first packet with an RTP timestamp.
+    ///
+    /// @note Only the most recent few timestamps are remembered.
+    ///
+    /// @param[in] timestamp RTP timestamp.
+    /// @param[out] arrival Arrival time passed to OnPacket.
+    /// @return Whether the timestamp was found.
+    bool GetFirstArrival(DWORD timestamp, REFERENCE_TIME &arrival) const;
+
+    ///
+    /// Get the interarrival jitter, as defined by RFC 3550, section 6.4.1.
+    ///
+    /// @return Jitter in RTP timestamp units.
+    DWORD GetJitter() const;
+
+protected:
+    ///
+    /// Extend an RTP timestamp to 64 bits relative to those seen before.
+    LONGLONG Extend(DWORD timestamp);
+
+    ///
+    /// Convert an RTP timestamp difference to 100-nanosecond units.
+    REFERENCE_TIME ToReferenceTime(LONGLONG ticks) const;
+
+    DWORD m_clockRate;
+
+    ///
+    /// Whether Extend has been called.
+    bool m_extended;
+
+    ///
+    /// Highest extended timestamp so far.
+    LONGLONG m_highest;
+
+    ///
+    /// Extended timestamp of the first packet or sender report.
+    LONGLONG m_first;
+
+    ///
+    /// Whether a sender report has arrived.
+    bool m_haveSenderReport;
+
+    ///
+    /// Extended RTP timestamp and NTP time (in 100-nanosecond units) of the
+    /// most recent sender report.
+    LONGLONG m_reportTimestamp;
+    REFERENCE_TIME m_reportTime;
+
+    ///
+    /// NTP time (in 100-nanosecond units) of m_first.
+    REFERENCE_TIME m_origin;
+
+    ///
+    /// Jitter, scaled by 16 as in RFC 3550, appendix A.8.
+    LONGLONG m_jitter;
+
+    ///
+    /// Transit time (arrival in RTP units minus RTP timestamp) of the
+    /// previous packet.
+    LONGLONG m_transit;
+    bool m_haveTransit;
+
+    ///
+    /// Number of distinct RTP timestamps whose first arrival we remember.
+    static const size_t ARRIVALS = 64;
+
+    ///
+    /// Ring of RTP timestamps and the arrival of the first packet of each.
+    DWORD m_arrivalTimestamps[ARRIVALS];
+    REFERENCE_TIME m_arrivals[ARRIVALS];
+
+    ///
+    /// Position in the ring of the most recent timestamp.
+    size_t m_lastArrival;
+
+    ///
+    /// Number of entries in the ring.
+    size_t m_arrivalCount;
+};
+
+///
+/// H.264-specific behavior.
+///
+/// @note This is a thin adapter from the RTSPUDPEncoding interface onto
+/// H264Depacketizer, which does the per-packet work. ParseFmtp picks the
+/// depacketizer for the session's packetization mode once; each packet then
+/// goes through a single indirect call straight into that instantiation.
+class RTSPUDPH264 : public RTSPUDPEncoding
+{
+public:
+    RTSPUDPH264();
+
+    ///
+    /// Get FOURCC representing video format on this stream.
+    ///
+    /// @return FOURCC for video stream.
+    DWORD GetFOURCC() const;
+
+    ///
+    /// Get MIME subtype for this encoding.
+    ///
+    /// @return MIME subtype.
+    const string &GetMimeSubtypeName() const;
+
+    ///
+    /// Determine whether this packet contains the last part of a frame.
+    ///
+    /// @param[in] packet RTP packet.
+    /// @return Whether this is an end-of-frame packet.
+    bool EndOfFrame(RTPPacket *packet) const;
+
+    ///
+    /// Determine whether this packet contains the last part of a frame.
+    ///
+    /// @note Packet may be any type H264Depacketizer accepts, such as
+    /// RTPPacketView.
+    ///
+    /// @param[in] packet RTP packet.
+    /// @return Whether this is an end-of-frame packet.
+    template <class Packet>
+    bool EndOfFrame(Packet *packet) const;
+
+    ///
+    /// Extract one or more partial frames with the same timestamp.
+    ///
+    /// @note A frame is composed of a sequence of parts with the same
+    /// timestamp and is usually fragmented across mutiple RTP packets.
+    ///
+    /// @param[in] packet RTP packet.
+    /// @param[in] marker Whether marker bit was set in RTP header (unused).
+    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
+    /// @param[in,out] frame Video frame under construction.
+    /// @param[out] fullFrame Whether the entire frame has been read.
+    /// @param[out] keyFrame Whether this is a keyframe.
+    void ExtractFrame(RTPPacket *packet, bool marker,
+        const vector<BYTE> &configBytes, vector<BYTE> &frame, bool &fullFrame,
+        bool &keyFrame);
+
+    ///
+    /// Extract one or more partial frames with the same timestamp.
+    ///
+    /// @note Packet may be any type H264Depacketizer accepts, such as
+    /// RTPPacketView, so packets from RTPBatchReceiver get the same
+    /// packetization mode, timing and load shedding as RTPPackets.
+    ///
+    /// @note The arrival time feeds the jitter and the first-packet-to-sample
+    /// latency, so it should be taken when the socket delivered the packet,
+    /// not now; otherwise both include our own queueing and processing. The
+    /// RTPPacket overload, which has no arrival time, uses RTPClock::Now.
+    ///
+    /// @param[in] packet RTP packet.
+    /// @param[in] arrival When the packet was received, on RTPClock::Now's
+    /// clock.
+    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
+    /// @param[in,out] frame Video frame under construction.
+    /// @param[out] fullFrame Whether the entire frame has been read.
+    /// @param[out] keyFrame Whether this is a keyframe.
+    template <class Packet>
+    void ExtractFrame(Packet *packet, REFERENCE_TIME arrival,
+        const vector<BYTE> &configBytes, vector<BYTE> &frame, bool &fullFrame,
+        bool &keyFrame);
+
+    ///
+    /// Determine whether the last packet completed more frames than
+    /// ExtractFrame returned.
+    ///
+    /// @note Only in interleaved mode, where one packet can release several
+    /// frames from the reorder buffer.
+    ///
+    /// @return Whether there is a pending frame.
+    bool HasPendingFrame() const;
+
+    ///
+    /// Extract the next frame completed by the last packet, if any.
+    ///
+    /// @param[out] frame Receives the frame, replacing what was there.
+    /// @param[out] fullFrame Whether a frame was extracted.
+    /// @param[out] keyFrame Whether this is a keyframe.
+    void ExtractPendingFrame(vector<BYTE> &frame, bool &fullFrame,
+        bool &keyFrame);
+
+    ///
+    /// Get the number of frames dropped because they were still pending
+    /// when the next packet arrived.
+    ///
+    /// @return Count.
+    unsigned long GetDroppedFrameCount() const;
+
+    ///
+    /// Construct media sample containing compressed frame.
+    ///
+    /// @param[in] Begin Beginning of the compressed frame.
+    /// @param[in] End One past the end of the compressed frame.
+    /// @param[in] keyFrame Whether this is a keyframe.
+    /// @param[in] configBytes Configuration bytes from the SDP line, a=fmtp.
+    /// @param[in] source Reference back to containing RTSPSource.
+    /// @param[in,out] got_keyframe Whether an keyframe has been encountered yet (unused).
+    /// @param[out] sample Where sample is constructed.
+    /// @return Whether the sample was constructed.
+    bool ConstructMediaSample(const BYTE *Begin, const BYTE *End,
+        bool keyFrame, const vector<BYTE> &configBytes,
+        const RTSPSource &source, bool &got_keyframe,
+        CComPtr<IMediaSample> &sample) const;
+
+    ///
+    /// Align presentation times with an RTCP sender report for this stream.
+    ///
+    /// @param[in] ntpSeconds NTP timestamp, most significant word.
+    /// @param[in] ntpFraction NTP timestamp, least significant word.
+    /// @param[in] timestamp RTP timestamp corresponding to the NTP timestamp.
+    void OnSenderReport(DWORD ntpSeconds, DWORD ntpFraction, DWORD timestamp);
+
+    ///
+    /// Get the interarrival jitter of this stream.
+    ///
+    /// @return Jitter in 90 kHz RTP timestamp units.
+    DWORD GetJitter() const;
+
+    ///
+    /// Get the latencies from the arrival of the first packet of each frame
+    /// to the construction of its media sample.
+    ///
+    /// @return Latency histogram.
+    const LatencyHistogram &GetLatencyHistogram() const;
+
+    ///
+    /// Get the policy for dropping frames from this stream under load.
+    ///
+    /// @note Use it to set the stream's priority and report queue depth.
+    ///
+    /// @return Load shedder.
+    H264LoadShedder &GetLoadShedder();
+
+protected:
+    ///
+    /// Parse line containing SDP fmtp attribute.
+    ///
+    /// @post config is non-empty if returns true, empty if false.
+    ///
+    /// @param[in] line Line containing the fmtp attribute.
+    /// @param[out] config Configuration bytes.
+    /// @return Whether the fmtp attribute was parsed.
+    bool ParseFmtp(const string &line, vector<BYTE> &config) const;
+
+    ///
+    /// Parse a config string from an RTSP header.
+    ///
+    /// @param bytes[in] Config bytes.
+    /// @param width[out] Receives video width.
+    /// @param height[out] Receives video height.
+    /// @param frameRate[out] Frames per second. Not used.
+    /// @return true if successful.
+    bool ParseConfig(const vector<BYTE> &bytes, int &width, int &height,
+        double &frameRate) const;
+
+    ///
+    /// Compute the presentation times of the frame just extracted, whose RTP
+    /// timestamp is m_sampleTimestamp.
+    void StampFrame();
+
+    ///
+    /// The parts of an RTP packet that the depacketizers read.
+    ///
+    /// @note Every packet type is reduced to this, so that one instantiation
+    /// of each depacketizer serves them all and can be chosen once, in
+    /// ParseFmtp.
+    class Payload
+    {
+    public:
+        template <class Packet>
+        explicit Payload(Packet *packet) :
+            m_data(packet->GetPayloadData()),
+            m_length(packet->GetPayloadLength()),
+            m_timestamp(packet->GetTimestamp()) {}
+
+        const BYTE *GetPayloadData() const { return m_data; }
+        size_t GetPayloadLength() const { return m_length; }
+        DWORD GetTimestamp() const { return m_timestamp; }
+
+    private:
+        const BYTE *m_data;
+        size_t m_length;
+        DWORD m_timestamp;
+    };
+
+    ///
+    /// Depacketizer specialized for non-interleaved sessions.
+    ///
+    /// @note Our decoders take Annex B byte streams.
+    ///
+    /// @note Also used for single NAL unit sessions. Some cameras send
+    /// fragmentation units whatever packetization mode they advertise, and
+    /// the single NAL unit specialization would drop them; it saves too
+    /// little per packet to be worth a black picture.
+    typedef H264Depacketizer<H264_NON_INTERLEAVED_MODE, AnnexBFormat>
+        Depacketizer;
+
+    ///
+    /// Depacketizer specialized for interleaved sessions.
+    typedef H264Depacketizer<H264_INTERLEAVED_MODE, AnnexBFormat>
+        InterleavedDepacketizer;
+
+    ///
+    /// Entry points of the depacketizer for the session's packetization mode.
+    typedef bool (*EndOfFrameFunction)(Payload *payload);
+    typedef void (RTSPUDPH264::*ExtractFrameFunction)(Payload *payload,
+        const vector<BYTE> &configBytes, vector<BYTE> &frame,
+        bool &fullFrame, bool &keyFrame);
+
+    ///
+    /// Extract frames with m_depacketizer or m_interleavedDepacketizer.
+    ///
+    /// @note The ExtractFrameFunctions ParseFmtp chooses between.
+    void ExtractNonInterleavedFrame(Payload *payload,
+        const vector<BYTE> &configBytes, vector<BYTE> &frame,
+        bool &fullFrame, bool &keyFrame);
+    void ExtractInterleavedFrame(Payload *payload,
+        const vector<BYTE> &configBytes, vector<BYTE> &frame,
+        bool &fullFrame, bool &keyFrame);
+
+    ///
+    /// Reassembles frames from the RTP packets on a non-interleaved stream.
+    Depacketizer m_depacketizer;
+
+    ///
+    /// Reassembles frames from the RTP packets on an interleaved stream.
+    ///
+    /// @note Mutable because ParseFmtp, which is const, configures it.
+    mutable InterleavedDepacketizer m_interleavedDepacketizer;
+
+    ///
+    /// Entry points for the packetization mode from the SDP line, a=fmtp.
+    ///
+    /// @note Mutable because ParseFmtp, which is const, chooses them.
+    mutable EndOfFrameFunction m_endOfFrame;
+    mutable ExtractFrameFunction m_extractFrame;
+
+    ///
+    /// RTP clock rate for H.264, from RFC 6184.
+    static const DWORD CLOCK_RATE = 90000;
+
+    ///
+    /// Maps RTP timestamps to presentation times and keeps the jitter.
+    RTPClock m_clock;
+
+    ///
+    /// RTP timestamp of the most recent full frame, and of the packet that
+    /// carried its start.
+    DWORD m_sampleTimestamp;
+    DWORD m_sampleArrivalTimestamp;
+
+    ///
+    /// Presentation start and end times of the most recent full frame.
+    ///
+    /// @note ConstructMediaSample stamps the sample with these. The end time
+    /// is only valid once m_frameDuration is known.
+    REFERENCE_TIME m_sampleStart;
+    REFERENCE_TIME m_sampleEnd;
+
+    ///
+    /// Interval between the two most recent full frames with different
+    /// timestamps, used as the duration of each frame, or 0 until there
+    /// have been two.
+    REFERENCE_TIME m_frameDuration;
+
+    ///
+    /// Whether m_sampleStart is valid.
+    bool m_haveSample;
+
+    ///
+    /// First-packet-to-sample latencies.
+    ///
+    /// @note Mutable because ConstructMediaSample, which is const, records
+    /// them.
+    mutable LatencyHistogram m_latency;
+
+    ///
+    /// Policy for dropping frames under load, shared by both depacketizers.
+    ///
+    /// @note Mutable because ParseConfig, which is const, gives it the
+    /// sequence parameters it needs to parse slice headers.
+    mutable H264LoadShedder m_shedder;
+};
+
+template <class Packet>
+inline bool
+RTSPUDPH264::
+EndOfFrame(Packet *packet) const
+{
+    assert(packet != NULL);
+
+    Payload payload(packet);
+    return m_endOfFrame(&payload);
+}
+
+template <class Packet>
+inline void
+RTSPUDPH264::
+ExtractFrame(Packet *packet, REFERENCE_TIME arrival,
+    const vector<BYTE> &configBytes, vector<BYTE> &frame, bool &fullFrame,
+    bool &keyFrame)
+{
+    assert(packet != NULL);
+
+    Payload payload(packet);
+    m_clock.OnPacket(payload.GetTimestamp(), arrival);
+
+    (this->*m_extractFrame)(&payload, configBytes, frame, fullFrame,
+        keyFrame);
+
+    if (fullFrame)
+    {
+        StampFrame();
+    }
+}